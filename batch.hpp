@@ -0,0 +1,224 @@
+#pragma once
+
+#include "bf.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+#include <sched.h>
+#include <sys/syscall.h>
+
+constexpr int mpol_preferred = 1;
+constexpr int mpol_interleave = 3;
+
+// Parses sysfs cpu lists such as "0-3,8-11".
+inline std::vector<int> parse_cpu_list(const std::string &list)
+{
+    std::vector<int> cpus;
+    size_t position = 0;
+    while (position < list.size())
+    {
+        size_t end = list.find(',', position);
+        if (std::string::npos == end)
+        {
+            end = list.size();
+        }
+
+        std::string range = list.substr(position, end - position);
+        size_t dash = range.find('-');
+        if (!range.empty() && std::isdigit(static_cast<unsigned char>(range[0])))
+        {
+            int first = std::stoi(range);
+            int last = std::string::npos == dash ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; ++cpu)
+            {
+                cpus.push_back(cpu);
+            }
+        }
+        position = end + 1;
+    }
+    return cpus;
+}
+
+struct NumaNode
+{
+    int id;
+    std::vector<int> cpus;
+};
+
+// Nodes from /sys/devices/system/node, or a single node with every cpu we may
+// run on when the machine doesn't expose any.
+inline std::vector<NumaNode> numa_topology()
+{
+    std::vector<NumaNode> nodes;
+    std::error_code ec;
+    for (const auto &entry : std::filesystem::directory_iterator("/sys/devices/system/node", ec))
+    {
+        std::string name = entry.path().filename();
+        if (0 != name.rfind("node", 0) || name.size() == 4 || !std::isdigit(static_cast<unsigned char>(name[4])))
+        {
+            continue;
+        }
+
+        std::ifstream cpulist(entry.path() / "cpulist");
+        std::string list;
+        std::getline(cpulist, list);
+        std::vector<int> cpus = parse_cpu_list(list);
+        if (!cpus.empty())
+        {
+            nodes.push_back({std::stoi(name.substr(4)), std::move(cpus)});
+        }
+    }
+
+    if (nodes.empty())
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        sched_getaffinity(0, sizeof(set), &set);
+        NumaNode node{0, {}};
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                node.cpus.push_back(cpu);
+            }
+        }
+        nodes.push_back(std::move(node));
+    }
+
+    std::sort(nodes.begin(), nodes.end(), [](const NumaNode &a, const NumaNode &b) { return a.id < b.id; });
+    return nodes;
+}
+
+// Sets the policy of pages that haven't been touched yet. Failing is harmless,
+// the pages just land wherever the kernel would have put them anyway.
+inline void bind_pages(void *pages, size_t size, int mode, const std::vector<int> &node_ids)
+{
+    unsigned long mask[16] = {};
+    unsigned long max_node = 0;
+    for (int id : node_ids)
+    {
+        if (id >= 0 && static_cast<size_t>(id) < sizeof(mask) * 8)
+        {
+            mask[id / 64] |= 1ul << (id % 64);
+            max_node = std::max<unsigned long>(max_node, id + 2);
+        }
+    }
+    syscall(SYS_mbind, pages, round_to_pages(size), mode, mask, max_node, 0);
+}
+
+inline void pin_to_cpu(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+using BatchState = BrainfuckState<size_t, size_t, DirtyTrackingTape>;
+using BatchCode = FlyweightCode<BatchState, ThreadVectorOutputter, ThreadSpanInputter>;
+using BatchProgram = BrainfuckInterpreter<BatchCode, BatchState>;
+
+struct BatchReport
+{
+    size_t runs;
+    uint64_t steps;
+    uint64_t output_bytes;
+    double seconds;
+};
+
+// Runs one program over every input on pinned workers spread across the nodes.
+// With node_local the program is decoded once per node and each worker's tape and
+// buffers are first touched on its own node; otherwise one shared copy of the
+// program is used and tapes are interleaved over all nodes.
+inline BatchReport run_batch(
+    const std::string &code_string,
+    const std::vector<std::vector<uint8_t>> &inputs,
+    size_t workers,
+    bool node_local)
+{
+    std::vector<NumaNode> nodes = numa_topology();
+    std::vector<int> node_ids;
+    for (const NumaNode &node : nodes)
+    {
+        node_ids.push_back(node.id);
+    }
+
+    std::vector<std::unique_ptr<BatchProgram>> replicas(node_local ? nodes.size() : 1);
+    std::vector<std::once_flag> decoded(replicas.size());
+    if (!node_local)
+    {
+        replicas[0] = std::make_unique<BatchProgram>(BatchCode(code_string));
+    }
+
+    LoopWatch loops(code_string);
+    std::atomic<size_t> next_input{0};
+    std::atomic<uint64_t> total_steps{0};
+    std::atomic<uint64_t> total_output{0};
+
+    auto work = [&](size_t worker) {
+        size_t node_index = worker % nodes.size();
+        const NumaNode &node = nodes[node_index];
+        pin_to_cpu(node.cpus[(worker / nodes.size()) % node.cpus.size()]);
+
+        // The first worker on a node decodes the node's copy, so it lands there.
+        size_t replica = node_local ? node_index : 0;
+        std::call_once(decoded[replica], [&]() {
+            if (nullptr == replicas[replica])
+            {
+                replicas[replica] = std::make_unique<BatchProgram>(BatchCode(code_string));
+            }
+        });
+        const BatchProgram &program = *replicas[replica];
+
+        RunLimits limits;
+        BatchState state{0ull, 0ull, DirtyTrackingTape(limits.tape_size)};
+        if (node_local)
+        {
+            bind_pages(state.field.data(), state.field.size(), mpol_preferred, {node.id});
+        }
+        else
+        {
+            bind_pages(state.field.data(), state.field.size(), mpol_interleave, node_ids);
+        }
+
+        std::vector<uint8_t> input;
+        std::vector<uint8_t> output;
+        ThreadVectorOutputter::t_output = &output;
+
+        uint64_t steps = 0;
+        uint64_t output_bytes = 0;
+        for (size_t i = next_input++; i < inputs.size(); i = next_input++)
+        {
+            input.assign(inputs[i].begin(), inputs[i].end());
+            SpanInput span_input{input, 0};
+            ThreadSpanInputter::t_input = &span_input;
+
+            output.clear();
+            steps += execute_limited(program, state, limits, []() { return false; }, &loops).steps;
+            output_bytes += output.size();
+            reset(state);
+        }
+
+        total_steps += steps;
+        total_output += output_bytes;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t worker = 0; worker < workers; ++worker)
+    {
+        threads.emplace_back(work, worker);
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    return {inputs.size(), total_steps, total_output, elapsed.count()};
+}
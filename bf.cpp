@@ -1,372 +1,691 @@
-#include <inttypes.h>
-#include <cstdio>
-#include <vector>
-#include <utility>
-#include <memory>
-#include <string>
-#include <map>
-
-#include <algorithm>
+#include "bf.hpp"
+#include "batch.hpp"
+#include "checkpoint.hpp"
+#include "closure.hpp"
+#include "packed.hpp"
+#include "metrics.hpp"
+#include "optimizer.hpp"
+#include "server.hpp"
+#include "sourcemap.hpp"
+#include "stream.hpp"
+#include "tailcall.hpp"
 
 #include <iostream>
 #include <fstream>
 #include <streambuf>
 
-class StdOutputter
-{
-public:
-    void out(uint8_t x) const
-    {
-        std::putchar(x);
-    }
-};
+#include <csignal>
+#include <cstdlib>
 
-class HexOutputter
-{
-public:
-    void out(uint8_t x) const
-    {
-        std::printf("%02x", x & 0xff);
-    }
-};
+#include <sys/shm.h>
+#include <sys/wait.h>
 
-class StdInputter
+std::string read_code(const char *path)
 {
-public:
-    uint8_t in() const
-    {
-        return std::getchar();
-    }
-};
+    std::ifstream source_stream(path);
 
-template <
-    class DataCounterPolicy = size_t,
-    class ProgramCounterPolicy = size_t,
-    class FieldPolicy = uint8_t *>
-struct BrainfuckState
-{
-public:
-    DataCounterPolicy data_counter;
-    ProgramCounterPolicy program_counter;
-    FieldPolicy field;
-};
+    // This could be optimized by reserving...
+    std::string code_string;
 
-template <class BFState = BrainfuckState<>>
-class Instruction
-{
-public:
-    virtual void execute(BFState &) const = 0;
-    virtual ~Instruction() = default;
-};
+    std::copy_if(
+        (std::istreambuf_iterator<char>(source_stream)),
+        std::istreambuf_iterator<char>(),
+        std::back_inserter(code_string),
+        is_bf_char);
+
+    return code_string;
+}
+
+// AFL finds out the target is persistent by grepping the binary for this.
+__attribute__((used)) static const char *const afl_persistent_signature = "##SIG_AFL_PERSISTENT##";
 
-template <class BFState = BrainfuckState<>>
-class NextDataInstruction : public Instruction<BFState>
+constexpr int afl_control_fd = 198;
+constexpr int afl_status_fd = afl_control_fd + 1;
+constexpr unsigned afl_persistent_runs = 1000;
+constexpr uint64_t afl_max_steps = 1ull << 24;
+
+uint8_t *afl_attach_coverage_map()
 {
-public:
-    virtual void execute(BFState &state) const final
+    const char *shm_id = std::getenv("__AFL_SHM_ID");
+    if (nullptr == shm_id)
     {
-        state.data_counter++;
+        return nullptr;
     }
-};
 
-template <class BFState = BrainfuckState<>>
-class PrevDataInstruction : public Instruction<BFState>
-{
-public:
-    virtual void execute(BFState &state) const final
+    void *map = shmat(std::atoi(shm_id), nullptr, 0);
+    if (reinterpret_cast<void *>(-1) == map)
     {
-        state.data_counter--;
+        return nullptr;
     }
-};
+    return static_cast<uint8_t *>(map);
+}
 
-template <class BFState = BrainfuckState<>>
-class IncDataInstruction : public Instruction<BFState>
+// Runs the fork server in the original process and only returns in the children,
+// or straight away when nobody is listening on the AFL descriptors.
+void afl_fork_server()
 {
-public:
-    virtual void execute(BFState &state) const final
+    uint32_t message = 0;
+    if (sizeof(message) != write(afl_status_fd, &message, sizeof(message)))
     {
-        state.field[state.data_counter]++;
+        return;
     }
-};
 
-template <class BFState = BrainfuckState<>>
-class DecDataInstruction : public Instruction<BFState>
-{
-public:
-    virtual void execute(BFState &state) const final
+    pid_t child = -1;
+    bool child_stopped = false;
+
+    for (;;)
     {
-        state.field[state.data_counter]--;
+        uint32_t was_killed;
+        if (sizeof(was_killed) != read(afl_control_fd, &was_killed, sizeof(was_killed)))
+        {
+            _exit(1);
+        }
+
+        // A stopped child that timed out was killed behind our back, reap it.
+        if (child_stopped && was_killed)
+        {
+            child_stopped = false;
+            waitpid(child, nullptr, 0);
+        }
+
+        if (child_stopped)
+        {
+            kill(child, SIGCONT);
+            child_stopped = false;
+        }
+        else
+        {
+            child = fork();
+            if (child < 0)
+            {
+                _exit(1);
+            }
+            if (0 == child)
+            {
+                close(afl_control_fd);
+                close(afl_status_fd);
+                return;
+            }
+        }
+
+        if (sizeof(child) != write(afl_status_fd, &child, sizeof(child)))
+        {
+            _exit(1);
+        }
+
+        int status;
+        if (waitpid(child, &status, WUNTRACED) < 0)
+        {
+            _exit(1);
+        }
+        child_stopped = WIFSTOPPED(status);
+
+        if (sizeof(status) != write(afl_status_fd, &status, sizeof(status)))
+        {
+            _exit(1);
+        }
     }
-};
+}
 
-template <class BFState = BrainfuckState<>>
-class JumpZeroInstruction : public Instruction<BFState>
+std::vector<uint8_t> read_all_stdin()
 {
-public:
-    JumpZeroInstruction(size_t to)
-        : m_to(to)
-    {
-    }
+    std::vector<uint8_t> input;
+    uint8_t chunk[0x1000];
 
-    virtual void execute(BFState &state) const final
+    // AFL rewrites the same file between persistent runs.
+    lseek(STDIN_FILENO, 0, SEEK_SET);
+    for (;;)
     {
-        if (0 == state.field[state.data_counter])
+        ssize_t ret = read(STDIN_FILENO, chunk, sizeof(chunk));
+        if (ret < 0 && EINTR == errno)
         {
-            state.program_counter = m_to;
+            continue;
         }
+        if (ret <= 0)
+        {
+            break;
+        }
+        input.insert(input.end(), chunk, chunk + ret);
     }
+    return input;
+}
 
-private:
-    size_t m_to;
-};
-
-template <class BFState = BrainfuckState<>>
-class JumpNonzeroInstruction : public Instruction<BFState>
+int run_afl(std::string code_string)
 {
-public:
-    JumpNonzeroInstruction(size_t to)
-        : m_to(to)
+    uint8_t *coverage_map = afl_attach_coverage_map();
+
+    BrainfuckState<size_t, CoverageProgramCounter, MemfdTape> state{
+        0ull,
+        0ull,
+        MemfdTape(0x2000),
+    };
+
+    SpanInput span_input{{}, 0};
+    auto code = FlyweightCode<decltype(state), NullOutputter, SpanInputter>(
+        code_string,
+        NullOutputter(),
+        SpanInputter(&span_input));
+
+    LoopWatch loops(code_string);
+    BrainfuckInterpreter<decltype(code), decltype(state)> interpreter(std::move(code));
+
+    // Everything before the first read is the same for every input, so run it
+    // once and have each run start from a snapshot taken there. A prefix that
+    // runs off the tape or out of steps is left for the runs to report.
+    uint64_t prefix_steps = 0;
+    while (!interpreter.finished(state) && ',' != code_string[state.program_counter] &&
+           prefix_steps < afl_max_steps && state.data_counter < state.field.size())
+    {
+        interpreter.step(state);
+        ++prefix_steps;
+    }
+    auto start = snapshot(state);
+    RunLimits limits{.max_steps = afl_max_steps - prefix_steps, .tape_size = state.field.size()};
+
+    if (nullptr != coverage_map)
     {
+        CoverageProgramCounter::attach(coverage_map);
     }
 
-    virtual void execute(BFState &state) const final
+    afl_fork_server();
+
+    for (unsigned run = 0; run < afl_persistent_runs; ++run)
     {
-        if (0 != state.field[state.data_counter])
+        std::vector<uint8_t> input = read_all_stdin();
+        span_input = SpanInput{input, 0};
+
+        // Stopping at the edge of the tape keeps the snapshot the next runs start
+        // from intact. Crashing on it, or on what looks like a hang, hands AFL a
+        // finding it can reproduce.
+        CoverageProgramCounter::begin_run();
+        RunResult result = execute_limited(interpreter, state, limits, []() { return false; }, &loops);
+        if (RunStatus::Finished != result.status)
+        {
+            std::abort();
+        }
+        restore(state, start);
+
+        if (nullptr == coverage_map)
         {
-            state.program_counter = m_to;
+            break;
         }
+        raise(SIGSTOP);
     }
+    return 0;
+}
 
-private:
-    size_t m_to;
-};
+int run_with_metrics(const char *path, const char *metrics_path)
+{
+    MetricsWriter metrics(metrics_path);
+    t_metrics_writer = &metrics;
+
+    metrics.phase("load");
+    std::string code_string = read_code(path);
+
+    BrainfuckState<PeakDataCounter, CountingProgramCounter, page_ptr> state{
+        0ull,
+        0ull,
+        allocate_pages(0x2000),
+    };
+
+    metrics.phase("bracket_matching");
+    auto code = FlyweightCode<decltype(state), CountingOutputter<StdOutputter>, CountingInputter<StdInputter>>(
+        std::move(code_string));
+
+    BrainfuckInterpreter<decltype(code), decltype(state)> interpreter(std::move(code));
 
-template <
-    class BFState = BrainfuckState<>,
-    class Inputter = StdInputter>
-class InInstruction : public Instruction<BFState>, private Inputter
+    metrics.phase("execution");
+    RunResult result = execute_limited(interpreter, state, RunLimits(), []() { return false; });
+    std::fflush(stdout);
+
+    metrics.finish(static_cast<int>(result.status));
+    t_metrics_writer = nullptr;
+    return RunStatus::Finished == result.status ? 0 : 1;
+}
+
+std::vector<uint8_t> read_file(const char *path)
+{
+    std::ifstream stream(path, std::ios::binary);
+    return std::vector<uint8_t>(
+        (std::istreambuf_iterator<char>(stream)),
+        std::istreambuf_iterator<char>());
+}
+
+int run_incremental(const char *path, char **input_paths, int input_count)
 {
-public:
-    virtual void execute(BFState &state) const final
+    IncrementalRunner runner(read_code(path));
+
+    for (int i = 0; i < input_count; ++i)
     {
-        state.field[state.data_counter] = this->in();
+        std::vector<uint8_t> output;
+        runner.run(read_file(input_paths[i]), output);
+        std::fwrite(output.data(), 1, output.size(), stdout);
     }
-};
 
-template <
-    class BFState = BrainfuckState<>,
-    class Outputter = StdOutputter>
-class OutInstruction : public Instruction<BFState>, private Outputter
+    std::cerr << runner.checkpoints() << " checkpoints, "
+              << runner.resumed_bytes() << " input bytes resumed past" << std::endl;
+    return 0;
+}
+
+void print_batch_report(const char *mode, const BatchReport &report)
+{
+    std::cerr << mode << ": " << report.runs << " runs in " << report.seconds << "s, "
+              << report.runs / report.seconds << " runs/s, "
+              << report.steps / report.seconds << " steps/s" << std::endl;
+}
+
+int run_batch_mode(const char *path, size_t workers, char **input_paths, int input_count)
 {
-public:
-    virtual void execute(BFState &state) const final
+    std::string code_string = read_code(path);
+
+    std::vector<std::vector<uint8_t>> inputs;
+    for (int i = 0; i < input_count; ++i)
     {
-        this->out(state.field[state.data_counter]);
+        inputs.push_back(read_file(input_paths[i]));
     }
-};
 
-template <
-    class BFCode,
-    class BFState = BrainfuckState<>>
-class BrainfuckInterpreter
+    print_batch_report("node-local", run_batch(code_string, inputs, workers, true));
+    print_batch_report("interleaved", run_batch(code_string, inputs, workers, false));
+    return 0;
+}
+
+using EngineState = BrainfuckState<size_t, size_t, page_ptr>;
+
+constexpr const char *engine_names[] = {"flyweight", "packed", "cached", "tailcall", "closure", "memo", "lazy"};
+
+// Runs the program on the named engine, false if there is no such engine. The
+// packed engines can run the optimized program, the flyweight one has no IR.
+// With report set, engines that share code say how much, at load time or for
+// the lazy engine once the run is over.
+template <class Outputter, class Inputter>
+bool interpret_with(
+    const char *engine,
+    const std::string &code_string,
+    bool optimized,
+    EngineState &state,
+    Outputter outputter,
+    Inputter inputter,
+    bool report = false)
 {
-public:
-    BrainfuckInterpreter(BFCode code)
-        : m_code(std::move(code))
+    auto compile = [&]() { return optimized ? optimize(PackedProgram(code_string)) : PackedProgram(code_string); };
+    bool lazy = 0 == std::strcmp(engine, "lazy");
+
+    if (0 == std::strcmp(engine, "flyweight"))
     {
+        auto code = FlyweightCode<EngineState, Outputter, Inputter>(code_string, outputter, inputter);
+        BrainfuckInterpreter<decltype(code), EngineState> interpreter(std::move(code));
+        interpreter.interpret(state);
     }
-
-    void step(BFState &state)
+    else if (0 == std::strcmp(engine, "packed"))
     {
-        m_code[state.program_counter]->execute(state);
-        state.program_counter++;
+        PackedInterpreter<EngineState, Outputter, Inputter> interpreter(compile(), outputter, inputter);
+        interpreter.interpret(state);
     }
-
-    void interpret(BFState &state)
+    else if (0 == std::strcmp(engine, "cached"))
+    {
+        CachedCellInterpreter<EngineState, Outputter, Inputter> interpreter(compile(), outputter, inputter);
+        interpreter.interpret(state);
+    }
+    else if (0 == std::strcmp(engine, "tailcall"))
+    {
+        TailCallInterpreter<EngineState, Outputter, Inputter> interpreter(compile(), outputter, inputter);
+        interpreter.interpret(state);
+    }
+    else if (0 == std::strcmp(engine, "closure") || 0 == std::strcmp(engine, "memo") || lazy)
     {
-        while (state.program_counter < m_code.size())
+        // The lazy engine optimizes each loop on its first entry instead.
+        ClosureOptions options{.memoize = 0 == std::strcmp(engine, "memo"), .lazy = lazy, .optimize_loops = optimized};
+        ClosureInterpreter<EngineState, Outputter, Inputter> interpreter(
+            lazy ? PackedProgram(code_string) : compile(), outputter, inputter, options);
+        auto print_sharing = [&interpreter]() {
+            double ratio = static_cast<double>(std::max<size_t>(interpreter.loops(), 1)) /
+                           std::max<size_t>(interpreter.unique_loops(), 1);
+            std::cerr << "closure: " << interpreter.loops() << " loops decoded as " << interpreter.unique_loops()
+                      << " (" << ratio << "x shared)" << std::endl;
+        };
+
+        // Eager engines have decoded every loop by now, the lazy one only once
+        // the run has entered them.
+        if (report && !lazy)
         {
-            step(state);
+            print_sharing();
+        }
+        interpreter.interpret(state);
+        if (report && lazy)
+        {
+            print_sharing();
         }
     }
+    else
+    {
+        return false;
+    }
+    return true;
+}
 
-private:
-    BFCode m_code;
-};
-
-template <class BFState>
-using unique_ptr_code = std::vector<std::unique_ptr<Instruction<BFState>>>;
-
-template <class BFState>
-unique_ptr_code<BFState> parse_code(const std::string &code)
+int run_engine(const char *engine, const char *path, bool optimized)
 {
-    unique_ptr_code<BFState> ret(code.length());
-    std::vector<size_t> brackets;
+    std::string code_string = read_code(path);
+    EngineState state{
+        0ull,
+        0ull,
+        allocate_pages(0x2000),
+    };
 
-    for (size_t i = 0; i < code.length(); ++i)
+    if (!interpret_with(engine, code_string, optimized, state, StdOutputter(), StdInputter(), true))
     {
-        switch (code[i])
+        std::cerr << "Unknown engine " << engine << ", expected one of";
+        for (const char *name : engine_names)
         {
-        case '+':
-            ret[i] = std::make_unique<IncDataInstruction<BFState>>();
-            break;
-        case '-':
-            ret[i] = std::make_unique<DecDataInstruction<BFState>>();
-            break;
-        case '>':
-            ret[i] = std::make_unique<NextDataInstruction<BFState>>();
-            break;
-        case '<':
-            ret[i] = std::make_unique<PrevDataInstruction<BFState>>();
-            break;
-        case '.':
-            ret[i] = std::make_unique<OutInstruction<BFState, StdOutputter>>();
-            break;
-        case ',':
-            ret[i] = std::make_unique<InInstruction<BFState>>();
-            break;
-        case '[':
-            brackets.push_back(i);
-            break;
-        case ']':
-            size_t j = brackets.back();
-            brackets.pop_back();
-
-            ret[j] = std::make_unique<JumpZeroInstruction<BFState>>(i);
-            ret[i] = std::make_unique<JumpNonzeroInstruction<BFState>>(j);
-            break;
+            std::cerr << " " << name;
         }
+        std::cerr << std::endl;
+        return 1;
     }
-    return ret;
+    return 0;
 }
 
-template <
-    class BFState,
-    class Outputter = StdOutputter,
-    class Inputter = StdInputter>
-class FlyweightCode
+// Runs the program segment by segment as it is read, for sources too big to hold.
+int run_stream(const char *path, bool optimized)
 {
-public:
-    template <typename StringT>
-    FlyweightCode(StringT code) : m_code(code)
+    EngineState state{
+        0ull,
+        0ull,
+        allocate_pages(0x2000),
+    };
+
+    StreamingRunner<EngineState> runner(optimized);
+    try
     {
-        build_bracket_map();
+        runner.run_file(state, path);
     }
-
-    const Instruction<BFState> *operator[](size_t i) const
+    catch (const std::system_error &error)
     {
-        switch (m_code[i])
-        {
-        case '+':
-            return &m_inc;
-            break;
-        case '-':
-            return &m_dec;
-            break;
-        case '>':
-            return &m_next;
-            break;
-        case '<':
-            return &m_prev;
-            break;
-        case '.':
-            return &m_out;
-            break;
-        case ',':
-            return &m_in;
-            break;
-        case '[':
-        case ']':
-            return m_bracket_map.at(i).get();
-            break;
-        }
-        return nullptr;
+        std::fflush(stdout);
+        std::cerr << "Can't stream " << path << ": " << error.what() << std::endl;
+        return 1;
     }
+    std::fflush(stdout);
+    std::cerr << "stream: " << runner.segments() << " segments, at most " << runner.peak_segment()
+              << " characters held" << std::endl;
+    return 0;
+}
+
+// Prints where the records of the packed program, optimized with -O, came from:
+// one line per run of records whose source offsets step evenly, as
+// "first+records offset line:column stride".
+int run_map(const char *path, bool optimized)
+{
+    std::ifstream stream(path, std::ios::binary);
+    std::string source((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
 
-    size_t size() const
+    SourceMap map(source);
+    PackedProgram program(source, &map);
+    if (optimized)
     {
-        return m_code.length();
+        program = optimize(program, map);
     }
 
-private:
-    void build_bracket_map()
+    map.for_each_run([&map](size_t first, size_t records, size_t offset, int32_t stride) {
+        SourceMap::Position position = map.position(offset);
+        std::cout << first << "+" << records << " " << offset << " " << position.line << ":" << position.column
+                  << " " << stride << "\n";
+    });
+    std::cerr << "map: " << program.size() << " records in " << map.runs() << " runs" << std::endl;
+    return 0;
+}
+
+// Idioms the optimizer has to lower, each with an opcode it has to lower them
+// to, and which have to print the same whichever engine runs them.
+struct LoweringCheck
+{
+    const char *name;
+    const char *code;
+    Opcode expected;
+};
+
+// 16-bit increments of cells 1 and 2, carried through the flag and scratch
+// cells 3 and 4 the wiki way.
+#define CIVI_INC16 ">+>>[-]+>[-]<<<[>>-<<[>>>+<<<-]]>>>[<<<+>>>-]<[-<+>]<<<"
+
+constexpr LoweringCheck lowering_checks[] = {
+    {"wide increment", CIVI_INC16 ">.>.", Opcode::WideAdd},
+    {"back to back wide increments", ",[" CIVI_INC16 CIVI_INC16 ",]>.>.", Opcode::WideAdd},
+    {"wide add of a cell", ",[-" CIVI_INC16 "]>.>.", Opcode::WideMulAdd},
+    {"equality", ",>,<[->-<]+>[<->[-]]<.", Opcode::Eq},
+    {"peeled invariant store", ",[>[-]+>+<<-]>.>.", Opcode::MulAdd},
+    {"divmod", ",>>,<<[->+>-[>+>>]>[+[-<+>]>+>>]<<<<<<]>>>.>.", Opcode::DivMod},
+    {"less than", ",>,>[-]>[-]>[-]+>[-]<<<<[>+>+<<-]>[<+>-]<<[>>+<<-]+>>>[>-]>[<<<<->>[-]>>->]<+<<"
+                  "[>-[>-]>[<<<<->>[-]+>>->]<+<<-]<<.",
+     Opcode::Lt},
+};
+
+// Inputs every check runs on, each ending in a zero so ,[...,] loops stop.
+constexpr std::string_view check_inputs[] = {
+    std::string_view("\x05\x03\x00", 3),
+    std::string_view("\x07\x07\x00", 3),
+    std::string_view("\xff\x02\x00", 3),
+};
+
+std::vector<uint8_t> run_for_check(const char *engine, const std::string &code_string, bool optimized,
+                                   std::string_view input)
+{
+    EngineState state{
+        0ull,
+        0ull,
+        allocate_pages(0x2000),
+    };
+    std::vector<uint8_t> output;
+    SpanInput span_input{std::span(reinterpret_cast<const uint8_t *>(input.data()), input.size()), 0};
+    interpret_with(engine, code_string, optimized, state, VectorOutputter(&output), SpanInputter(&span_input));
+    return output;
+}
+
+// Checks the optimizer still lowers the idioms it is meant to, and that every
+// engine running the optimized program prints what the flyweight engine does on
+// the original. Prints a line per check and fails if any of them doesn't hold.
+int run_check()
+{
+    int failed = 0;
+    for (const LoweringCheck &check : lowering_checks)
     {
-        std::vector<size_t> bracket_stack;
+        PackedProgram program = optimize(PackedProgram(check.code));
+        bool lowered = false;
+        for (size_t i = 0; i < program.size(); i += packed_length(program[i].opcode()))
+        {
+            lowered = lowered || check.expected == program[i].opcode();
+        }
 
-        for (size_t i = 0; i < m_code.length(); ++i)
+        std::string mismatches;
+        for (std::string_view input : check_inputs)
         {
-            if ('[' == m_code[i])
-            {
-                bracket_stack.push_back(i);
-            }
-            else if (']' == m_code[i])
+            std::vector<uint8_t> expected = run_for_check("flyweight", check.code, false, input);
+            for (const char *engine : engine_names)
             {
-                size_t j = bracket_stack.back();
-                bracket_stack.pop_back();
-
-                m_bracket_map[j] = std::make_unique<JumpZeroInstruction<BFState>>(i);
-                m_bracket_map[i] = std::make_unique<JumpNonzeroInstruction<BFState>>(j);
+                if (0 != std::strcmp(engine, "flyweight") && run_for_check(engine, check.code, true, input) != expected &&
+                    std::string::npos == mismatches.find(engine))
+                {
+                    mismatches += std::string(" ") + engine;
+                }
             }
         }
+
+        bool ok = lowered && mismatches.empty();
+        std::cerr << (ok ? "ok   " : "FAIL ") << check.name << (lowered ? "" : " (not lowered)")
+                  << (mismatches.empty() ? "" : " (differs on" + mismatches + ")") << std::endl;
+        failed += !ok;
     }
+    return 0 == failed ? 0 : 1;
+}
 
-    std::string m_code;
-    std::map<size_t, std::unique_ptr<Instruction<BFState>>> m_bracket_map;
+// Times every engine on the same program, with output thrown away and input at
+// EOF, and the packed engines once more on the optimized program.
+int run_bench(const char *path, unsigned runs)
+{
+    std::string code_string = read_code(path);
 
-    IncDataInstruction<BFState> m_inc;
-    DecDataInstruction<BFState> m_dec;
-    NextDataInstruction<BFState> m_next;
-    PrevDataInstruction<BFState> m_prev;
-    InInstruction<BFState, Inputter> m_in;
-    OutInstruction<BFState, Outputter> m_out;
-};
+    for (bool optimized : {false, true})
+    {
+        for (const char *engine : engine_names)
+        {
+            if (optimized && 0 == std::strcmp(engine, "flyweight"))
+            {
+                continue;
+            }
 
-inline bool is_bf_char(char c)
-{
-    switch (c)
-    {
-    case '+':
-    case '-':
-    case '>':
-    case '<':
-    case '.':
-    case ',':
-    case '[':
-    case ']':
-        return true;
-    }
-    return false;
+            auto start = std::chrono::steady_clock::now();
+            for (unsigned run = 0; run < runs; ++run)
+            {
+                EngineState state{
+                    0ull,
+                    0ull,
+                    allocate_pages(0x2000),
+                };
+                SpanInput no_input{{}, 0};
+                interpret_with(engine, code_string, optimized, state, NullOutputter(), SpanInputter(&no_input));
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::cerr << engine << (optimized ? " -O" : "") << ": " << elapsed.count() / runs * 1e3 << " ms/run"
+                      << std::endl;
+        }
+    }
+    return 0;
 }
 
 int main(int argc, char *argv[])
 {
+    if (2 == argc && 0 == std::strcmp(argv[1], "--check"))
+    {
+        return run_check();
+    }
+
     if (argc < 2)
     {
-        std::cerr << "Usage: " << argv[0] << " [bf-file]" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " [--afl | --client socket | --metrics file] [bf-file]" << std::endl;
+        std::cerr << "       " << argv[0] << " --serve socket [workers]" << std::endl;
+        std::cerr << "       " << argv[0] << " --incremental [bf-file] [input-file...]" << std::endl;
+        std::cerr << "       " << argv[0] << " --batch workers [bf-file] [input-file...]" << std::endl;
+        std::cerr << "       " << argv[0] << " --engine name [-O] [bf-file]" << std::endl;
+        std::cerr << "       " << argv[0] << " --bench [bf-file] [runs]" << std::endl;
+        std::cerr << "       " << argv[0] << " --stream [-O] [bf-file]" << std::endl;
+        std::cerr << "       " << argv[0] << " --map [-O] [bf-file]" << std::endl;
+        std::cerr << "       " << argv[0] << " --check" << std::endl;
         return 1;
     }
 
-    std::ifstream source_stream(argv[1]);
+    if (0 == std::strcmp(argv[1], "--afl"))
+    {
+        if (argc < 3)
+        {
+            std::cerr << "Usage: " << argv[0] << " --afl [bf-file]" << std::endl;
+            return 1;
+        }
+        return run_afl(read_code(argv[2]));
+    }
 
-    // This could be optimized by reserving...
-    std::string code_string;
+    if (0 == std::strcmp(argv[1], "--metrics"))
+    {
+        if (argc < 4)
+        {
+            std::cerr << "Usage: " << argv[0] << " --metrics file [bf-file]" << std::endl;
+            return 1;
+        }
+        return run_with_metrics(argv[3], argv[2]);
+    }
 
-    std::copy_if(
-        (std::istreambuf_iterator<char>(source_stream)),
-        std::istreambuf_iterator<char>(),
-        std::back_inserter(code_string),
-        is_bf_char);
+    if (0 == std::strcmp(argv[1], "--incremental"))
+    {
+        if (argc < 3)
+        {
+            std::cerr << "Usage: " << argv[0] << " --incremental [bf-file] [input-file...]" << std::endl;
+            return 1;
+        }
+        return run_incremental(argv[2], argv + 3, argc - 3);
+    }
 
-    BrainfuckState<size_t, size_t, std::unique_ptr<uint8_t[]>> state{
-        0ull,
-        0ull,
-        std::make_unique<uint8_t[]>(0x2000),
-    };
-    std::memset(state.field.get(), 0, 0x2000);
+    if (0 == std::strcmp(argv[1], "--batch"))
+    {
+        if (argc < 4)
+        {
+            std::cerr << "Usage: " << argv[0] << " --batch workers [bf-file] [input-file...]" << std::endl;
+            return 1;
+        }
+        size_t workers = std::max<size_t>(std::strtoul(argv[2], nullptr, 10), 1);
+        return run_batch_mode(argv[3], workers, argv + 4, argc - 4);
+    }
 
-    auto code = FlyweightCode<decltype(state)>(std::move(code_string));
+    if (0 == std::strcmp(argv[1], "--serve"))
+    {
+        if (argc < 3)
+        {
+            std::cerr << "Usage: " << argv[0] << " --serve socket [workers]" << std::endl;
+            return 1;
+        }
+        size_t workers = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : std::thread::hardware_concurrency();
+        Server server(argv[2], std::max<size_t>(workers, 1));
+        server.serve();
+        return 0;
+    }
 
-    BrainfuckInterpreter<decltype(code), decltype(state)> interpreter(std::move(code));
+    if (0 == std::strcmp(argv[1], "--client"))
+    {
+        if (argc < 4)
+        {
+            std::cerr << "Usage: " << argv[0] << " --client socket [bf-file]" << std::endl;
+            return 1;
+        }
+        int status = run_client(argv[2], read_code(argv[3]), read_all_stdin());
+        if (0 != status)
+        {
+            std::cerr << "run ended with status " << status << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (0 == std::strcmp(argv[1], "--engine"))
+    {
+        bool optimized = argc > 4 && 0 == std::strcmp(argv[3], "-O");
+        if (argc < (optimized ? 5 : 4))
+        {
+            std::cerr << "Usage: " << argv[0] << " --engine name [-O] [bf-file]" << std::endl;
+            return 1;
+        }
+        return run_engine(argv[2], argv[optimized ? 4 : 3], optimized);
+    }
+
+    if (0 == std::strcmp(argv[1], "--bench"))
+    {
+        if (argc < 3)
+        {
+            std::cerr << "Usage: " << argv[0] << " --bench [bf-file] [runs]" << std::endl;
+            return 1;
+        }
+        unsigned runs = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 10;
+        return run_bench(argv[2], std::max(runs, 1u));
+    }
+
+    if (0 == std::strcmp(argv[1], "--stream"))
+    {
+        bool optimized = argc > 3 && 0 == std::strcmp(argv[2], "-O");
+        if (argc < (optimized ? 4 : 3))
+        {
+            std::cerr << "Usage: " << argv[0] << " --stream [-O] [bf-file]" << std::endl;
+            return 1;
+        }
+        return run_stream(argv[optimized ? 3 : 2], optimized);
+    }
+
+    if (0 == std::strcmp(argv[1], "--map"))
+    {
+        bool optimized = argc > 3 && 0 == std::strcmp(argv[2], "-O");
+        if (argc < (optimized ? 4 : 3))
+        {
+            std::cerr << "Usage: " << argv[0] << " --map [-O] [bf-file]" << std::endl;
+            return 1;
+        }
+        return run_map(argv[optimized ? 3 : 2], optimized);
+    }
 
-    interpreter.interpret(state);
+    return run_engine("flyweight", argv[1], false);
 }
@@ -0,0 +1,1292 @@
+#pragma once
+
+#include <inttypes.h>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <utility>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <span>
+#include <map>
+#include <array>
+#include <optional>
+#include <memory_resource>
+#include <mutex>
+
+#include <algorithm>
+
+#include <stdexcept>
+#include <system_error>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+class StdOutputter
+{
+public:
+    void out(uint8_t x) const
+    {
+        std::putchar(x);
+    }
+};
+
+class HexOutputter
+{
+public:
+    void out(uint8_t x) const
+    {
+        std::printf("%02x", x & 0xff);
+    }
+};
+
+class NullOutputter
+{
+public:
+    void out(uint8_t) const
+    {
+    }
+};
+
+class StdInputter
+{
+public:
+    uint8_t in() const
+    {
+        return std::getchar();
+    }
+};
+
+struct SpanInput
+{
+    std::span<const uint8_t> data;
+    size_t position;
+};
+
+// Reads straight out of memory owned by the caller, which can be re-pointed between runs.
+// Running out behaves like getchar() hitting EOF.
+class SpanInputter
+{
+public:
+    SpanInputter(SpanInput *input = nullptr)
+        : m_input(input)
+    {
+    }
+
+    uint8_t in() const
+    {
+        if (m_input->position >= m_input->data.size())
+        {
+            return static_cast<uint8_t>(EOF);
+        }
+        return m_input->data[m_input->position++];
+    }
+
+private:
+    SpanInput *m_input;
+};
+
+class VectorOutputter
+{
+public:
+    VectorOutputter(std::vector<uint8_t> *output = nullptr)
+        : m_output(output)
+    {
+    }
+
+    void out(uint8_t x) const
+    {
+        m_output->push_back(x);
+    }
+
+private:
+    std::vector<uint8_t> *m_output;
+};
+
+// For code shared between threads: each thread binds its own input and output
+// before running.
+class ThreadSpanInputter
+{
+public:
+    uint8_t in() const
+    {
+        return SpanInputter(t_input).in();
+    }
+
+    static inline thread_local SpanInput *t_input = nullptr;
+};
+
+class ThreadVectorOutputter
+{
+public:
+    void out(uint8_t x) const
+    {
+        t_output->push_back(x);
+    }
+
+    static inline thread_local std::vector<uint8_t> *t_output = nullptr;
+};
+
+template <
+    class DataCounterPolicy = size_t,
+    class ProgramCounterPolicy = size_t,
+    class FieldPolicy = uint8_t *>
+struct BrainfuckState
+{
+public:
+    DataCounterPolicy data_counter;
+    ProgramCounterPolicy program_counter;
+    FieldPolicy field;
+};
+
+inline size_t page_size()
+{
+    static const size_t size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return size;
+}
+
+inline size_t round_to_pages(size_t size)
+{
+    return (size + page_size() - 1) & ~(page_size() - 1);
+}
+
+// A tape backed by a memfd and mapped MAP_PRIVATE over it. The memfd holds the
+// committed image, so restoring only drops the pages dirtied since the commit
+// instead of copying the whole tape back.
+class MemfdTape
+{
+public:
+    explicit MemfdTape(size_t size)
+        : m_size(round_to_pages(size))
+    {
+        m_fd = memfd_create("civi-tape", MFD_CLOEXEC);
+        if (-1 == m_fd)
+        {
+            throw std::system_error(errno, std::generic_category(), "memfd_create");
+        }
+
+        if (-1 == ftruncate(m_fd, m_size))
+        {
+            int err = errno;
+            close(m_fd);
+            throw std::system_error(err, std::generic_category(), "ftruncate");
+        }
+
+        void *data = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, m_fd, 0);
+        if (MAP_FAILED == data)
+        {
+            int err = errno;
+            close(m_fd);
+            throw std::system_error(err, std::generic_category(), "mmap");
+        }
+        m_data = static_cast<uint8_t *>(data);
+    }
+
+    MemfdTape(const MemfdTape &) = delete;
+    MemfdTape &operator=(const MemfdTape &) = delete;
+
+    ~MemfdTape()
+    {
+        munmap(m_data, m_size);
+        close(m_fd);
+    }
+
+    uint8_t &operator[](size_t i)
+    {
+        return m_data[i];
+    }
+
+    const uint8_t &operator[](size_t i) const
+    {
+        return m_data[i];
+    }
+
+    uint8_t *data()
+    {
+        return m_data;
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    // Makes the current contents the image that restore() returns to.
+    void commit()
+    {
+        size_t written = 0;
+        while (written < m_size)
+        {
+            ssize_t ret = pwrite(m_fd, m_data + written, m_size - written, written);
+            if (-1 == ret)
+            {
+                if (EINTR == errno)
+                {
+                    continue;
+                }
+                throw std::system_error(errno, std::generic_category(), "pwrite");
+            }
+            written += ret;
+        }
+        restore();
+    }
+
+    // Throws away the private copies, the next access faults the committed page back in.
+    void restore()
+    {
+        if (-1 == madvise(m_data, m_size, MADV_DONTNEED))
+        {
+            throw std::system_error(errno, std::generic_category(), "madvise");
+        }
+    }
+
+private:
+    int m_fd;
+    uint8_t *m_data;
+    size_t m_size;
+};
+
+class PageDeleter
+{
+public:
+    PageDeleter(size_t size = 0)
+        : m_size(size)
+    {
+    }
+
+    void operator()(uint8_t *pages) const
+    {
+        munmap(pages, m_size);
+    }
+
+private:
+    size_t m_size;
+};
+
+using page_ptr = std::unique_ptr<uint8_t[], PageDeleter>;
+
+// Anonymous pages come zeroed and page aligned, and cost nothing until touched.
+inline page_ptr allocate_pages(size_t size)
+{
+    size = round_to_pages(size);
+    void *pages = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == pages)
+    {
+        throw std::system_error(errno, std::generic_category(), "mmap");
+    }
+    return page_ptr(static_cast<uint8_t *>(pages), PageDeleter(size));
+}
+
+// A zeroed tape that remembers which blocks were touched, so reset() only
+// clears those. Reads through the non-const operator[] count as touches too.
+class DirtyTrackingTape
+{
+public:
+    explicit DirtyTrackingTape(size_t size, size_t block_size = 0x1000)
+        : m_size(size),
+          m_block_shift(block_shift(block_size)),
+          m_data(allocate_pages(size)),
+          m_dirty_bits(((size >> m_block_shift) + 64) / 64)
+    {
+    }
+
+    uint8_t &operator[](size_t i)
+    {
+        size_t block = i >> m_block_shift;
+        uint64_t mask = 1ull << (block % 64);
+        if (0 == (m_dirty_bits[block / 64] & mask))
+        {
+            m_dirty_bits[block / 64] |= mask;
+            m_dirty_blocks.push_back(block);
+        }
+        return m_data[i];
+    }
+
+    const uint8_t &operator[](size_t i) const
+    {
+        return m_data[i];
+    }
+
+    uint8_t *data()
+    {
+        return m_data.get();
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    size_t dirty_blocks() const
+    {
+        return m_dirty_blocks.size();
+    }
+
+    void reset()
+    {
+        size_t block_size = size_t(1) << m_block_shift;
+        for (size_t block : m_dirty_blocks)
+        {
+            size_t start = block << m_block_shift;
+            std::memset(m_data.get() + start, 0, std::min(block_size, m_size - start));
+            m_dirty_bits[block / 64] = 0;
+        }
+        m_dirty_blocks.clear();
+    }
+
+private:
+    static size_t block_shift(size_t block_size)
+    {
+        if (0 == block_size || 0 != (block_size & (block_size - 1)))
+        {
+            throw std::invalid_argument("block size must be a power of two");
+        }
+
+        size_t shift = 0;
+        while ((size_t(1) << shift) < block_size)
+        {
+            ++shift;
+        }
+        return shift;
+    }
+
+    size_t m_size;
+    size_t m_block_shift;
+    page_ptr m_data;
+    std::vector<uint64_t> m_dirty_bits;
+    std::vector<size_t> m_dirty_blocks;
+};
+
+// Keeps zeroed tapes around per power of two size class so runs don't pay for
+// allocating and clearing them. Returned tapes are reset, which only clears what
+// the run touched.
+class TapePool
+{
+public:
+    class Lease
+    {
+    public:
+        Lease(TapePool *pool, std::unique_ptr<DirtyTrackingTape> tape)
+            : m_pool(pool),
+              m_tape(std::move(tape))
+        {
+        }
+
+        Lease(Lease &&) = default;
+        Lease &operator=(Lease &&) = delete;
+
+        ~Lease()
+        {
+            if (nullptr != m_tape)
+            {
+                m_pool->release(std::move(m_tape));
+            }
+        }
+
+        uint8_t &operator[](size_t i)
+        {
+            return (*m_tape)[i];
+        }
+
+        const uint8_t &operator[](size_t i) const
+        {
+            return (*m_tape)[i];
+        }
+
+        uint8_t *data()
+        {
+            return m_tape->data();
+        }
+
+        size_t size() const
+        {
+            return m_tape->size();
+        }
+
+        void reset()
+        {
+            m_tape->reset();
+        }
+
+    private:
+        TapePool *m_pool;
+        std::unique_ptr<DirtyTrackingTape> m_tape;
+    };
+
+    explicit TapePool(size_t max_free_per_class = 16)
+        : m_max_free_per_class(max_free_per_class)
+    {
+    }
+
+    // Warms a size class up front so even the first runs find a tape waiting.
+    void reserve(size_t size, size_t count)
+    {
+        size_t size_class = class_of(size);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto &free_tapes = m_free[size_class];
+        while (free_tapes.size() < count)
+        {
+            free_tapes.push_back(std::make_unique<DirtyTrackingTape>(size_t(1) << size_class));
+        }
+    }
+
+    Lease acquire(size_t size)
+    {
+        size_t size_class = class_of(size);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto &free_tapes = m_free[size_class];
+            if (!free_tapes.empty())
+            {
+                std::unique_ptr<DirtyTrackingTape> tape = std::move(free_tapes.back());
+                free_tapes.pop_back();
+                return Lease(this, std::move(tape));
+            }
+        }
+        return Lease(this, std::make_unique<DirtyTrackingTape>(size_t(1) << size_class));
+    }
+
+private:
+    void release(std::unique_ptr<DirtyTrackingTape> tape)
+    {
+        tape->reset();
+
+        size_t size_class = class_of(tape->size());
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto &free_tapes = m_free[size_class];
+        if (free_tapes.size() < m_max_free_per_class)
+        {
+            free_tapes.push_back(std::move(tape));
+        }
+    }
+
+    static size_t class_of(size_t size)
+    {
+        size_t size_class = 0;
+        while ((size_t(1) << size_class) < std::max(size, page_size()))
+        {
+            ++size_class;
+        }
+        return size_class;
+    }
+
+    size_t m_max_free_per_class;
+    std::mutex m_mutex;
+    std::map<size_t, std::vector<std::unique_ptr<DirtyTrackingTape>>> m_free;
+};
+
+inline TapePool &default_tape_pool()
+{
+    static TapePool pool;
+    return pool;
+}
+
+template <
+    class DataCounterPolicy = size_t,
+    class ProgramCounterPolicy = size_t>
+struct BrainfuckSnapshot
+{
+public:
+    DataCounterPolicy data_counter;
+    ProgramCounterPolicy program_counter;
+};
+
+// Only one snapshot per tape is live at a time, taking a new one replaces the image.
+template <class DataCounterPolicy, class ProgramCounterPolicy, class FieldPolicy>
+BrainfuckSnapshot<DataCounterPolicy, ProgramCounterPolicy> snapshot(
+    BrainfuckState<DataCounterPolicy, ProgramCounterPolicy, FieldPolicy> &state)
+{
+    state.field.commit();
+    return {state.data_counter, state.program_counter};
+}
+
+template <class DataCounterPolicy, class ProgramCounterPolicy, class FieldPolicy>
+void restore(
+    BrainfuckState<DataCounterPolicy, ProgramCounterPolicy, FieldPolicy> &state,
+    const BrainfuckSnapshot<DataCounterPolicy, ProgramCounterPolicy> &snap)
+{
+    state.field.restore();
+    state.data_counter = snap.data_counter;
+    state.program_counter = snap.program_counter;
+}
+
+constexpr size_t coverage_map_size = 1 << 16;
+
+// A program counter that records every taken jump as an AFL style edge.
+// Plain assignment from a position is a jump, copying a counter is not.
+class CoverageProgramCounter
+{
+public:
+    CoverageProgramCounter(size_t pc = 0)
+        : m_pc(pc)
+    {
+    }
+
+    CoverageProgramCounter &operator=(size_t to)
+    {
+        size_t location = (to * 0x9e3779b1u >> 7) & (coverage_map_size - 1);
+        s_map[location ^ s_previous]++;
+        s_previous = location >> 1;
+        m_pc = to;
+        return *this;
+    }
+
+    size_t operator++(int)
+    {
+        return m_pc++;
+    }
+
+    operator size_t() const
+    {
+        return m_pc;
+    }
+
+    static void attach(uint8_t *map)
+    {
+        s_map = map;
+        s_previous = 0;
+    }
+
+    static void begin_run()
+    {
+        s_previous = 0;
+    }
+
+private:
+    size_t m_pc;
+
+    static inline uint8_t s_default_map[coverage_map_size];
+    static inline uint8_t *s_map = s_default_map;
+    static inline size_t s_previous = 0;
+};
+
+// Rewinds the state for another run, the tape decides how cheap that is.
+template <class DataCounterPolicy, class ProgramCounterPolicy, class FieldPolicy>
+void reset(BrainfuckState<DataCounterPolicy, ProgramCounterPolicy, FieldPolicy> &state)
+{
+    state.field.reset();
+    state.data_counter = DataCounterPolicy();
+    state.program_counter = ProgramCounterPolicy();
+}
+
+template <class BFState = BrainfuckState<>>
+class Instruction
+{
+public:
+    virtual void execute(BFState &) const = 0;
+    virtual ~Instruction() = default;
+};
+
+template <class BFState = BrainfuckState<>>
+class NextDataInstruction : public Instruction<BFState>
+{
+public:
+    virtual void execute(BFState &state) const final
+    {
+        state.data_counter++;
+    }
+};
+
+template <class BFState = BrainfuckState<>>
+class PrevDataInstruction : public Instruction<BFState>
+{
+public:
+    virtual void execute(BFState &state) const final
+    {
+        state.data_counter--;
+    }
+};
+
+template <class BFState = BrainfuckState<>>
+class IncDataInstruction : public Instruction<BFState>
+{
+public:
+    virtual void execute(BFState &state) const final
+    {
+        state.field[state.data_counter]++;
+    }
+};
+
+template <class BFState = BrainfuckState<>>
+class DecDataInstruction : public Instruction<BFState>
+{
+public:
+    virtual void execute(BFState &state) const final
+    {
+        state.field[state.data_counter]--;
+    }
+};
+
+template <class BFState = BrainfuckState<>>
+class JumpZeroInstruction : public Instruction<BFState>
+{
+public:
+    JumpZeroInstruction(size_t to)
+        : m_to(to)
+    {
+    }
+
+    virtual void execute(BFState &state) const final
+    {
+        if (0 == state.field[state.data_counter])
+        {
+            state.program_counter = m_to;
+        }
+    }
+
+private:
+    size_t m_to;
+};
+
+template <class BFState = BrainfuckState<>>
+class JumpNonzeroInstruction : public Instruction<BFState>
+{
+public:
+    JumpNonzeroInstruction(size_t to)
+        : m_to(to)
+    {
+    }
+
+    virtual void execute(BFState &state) const final
+    {
+        if (0 != state.field[state.data_counter])
+        {
+            state.program_counter = m_to;
+        }
+    }
+
+private:
+    size_t m_to;
+};
+
+template <
+    class BFState = BrainfuckState<>,
+    class Inputter = StdInputter>
+class InInstruction : public Instruction<BFState>, private Inputter
+{
+public:
+    InInstruction(Inputter inputter = Inputter())
+        : Inputter(std::move(inputter))
+    {
+    }
+
+    virtual void execute(BFState &state) const final
+    {
+        state.field[state.data_counter] = this->in();
+    }
+};
+
+template <
+    class BFState = BrainfuckState<>,
+    class Outputter = StdOutputter>
+class OutInstruction : public Instruction<BFState>, private Outputter
+{
+public:
+    OutInstruction(Outputter outputter = Outputter())
+        : Outputter(std::move(outputter))
+    {
+    }
+
+    virtual void execute(BFState &state) const final
+    {
+        this->out(state.field[state.data_counter]);
+    }
+};
+
+template <
+    class BFCode,
+    class BFState = BrainfuckState<>>
+class BrainfuckInterpreter
+{
+public:
+    BrainfuckInterpreter(BFCode code)
+        : m_code(std::move(code))
+    {
+    }
+
+    void step(BFState &state) const
+    {
+        m_code[state.program_counter]->execute(state);
+        state.program_counter++;
+    }
+
+    bool finished(const BFState &state) const
+    {
+        return state.program_counter >= m_code.size();
+    }
+
+    void interpret(BFState &state) const
+    {
+        while (state.program_counter < m_code.size())
+        {
+            step(state);
+        }
+    }
+
+private:
+    BFCode m_code;
+};
+
+inline bool is_bf_char(char c)
+{
+    switch (c)
+    {
+    case '+':
+    case '-':
+    case '>':
+    case '<':
+    case '.':
+    case ',':
+    case '[':
+    case ']':
+        return true;
+    }
+    return false;
+}
+
+// Bump allocates objects for the lifetime of a compiled program and frees them
+// all at once. Objects that need destructing get a small record in the arena
+// itself, so nothing is allocated on the side.
+class Arena
+{
+public:
+    explicit Arena(size_t initial_size = 0x1000)
+        : m_resource(initial_size)
+    {
+    }
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    ~Arena()
+    {
+        for (Finalizer *finalizer = m_finalizers; nullptr != finalizer; finalizer = finalizer->next)
+        {
+            finalizer->destroy(finalizer->object);
+        }
+    }
+
+    template <class T, class... Args>
+    T *create(Args &&...args)
+    {
+        if constexpr (std::is_trivially_destructible_v<T>)
+        {
+            return new (m_resource.allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        }
+        else
+        {
+            void *finalizer_memory = m_resource.allocate(sizeof(Finalizer), alignof(Finalizer));
+            T *object = new (m_resource.allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+            m_finalizers = new (finalizer_memory) Finalizer{
+                m_finalizers,
+                object,
+                [](void *p) { static_cast<T *>(p)->~T(); },
+            };
+            return object;
+        }
+    }
+
+    std::pmr::memory_resource *resource()
+    {
+        return &m_resource;
+    }
+
+private:
+    struct Finalizer
+    {
+        Finalizer *next;
+        void *object;
+        void (*destroy)(void *);
+    };
+
+    std::pmr::monotonic_buffer_resource m_resource;
+    Finalizer *m_finalizers = nullptr;
+};
+
+// Instructions laid out back to back in an arena, in execution order.
+template <class BFState>
+class ArenaCode
+{
+public:
+    ArenaCode()
+        : m_arena(std::make_unique<Arena>()),
+          m_instructions(m_arena->resource())
+    {
+    }
+
+    template <class InstructionT, class... Args>
+    void emplace(Args &&...args)
+    {
+        m_instructions.push_back(m_arena->create<InstructionT>(std::forward<Args>(args)...));
+    }
+
+    void reserve(size_t size)
+    {
+        m_instructions.reserve(size);
+    }
+
+    const Instruction<BFState> *operator[](size_t i) const
+    {
+        return m_instructions[i];
+    }
+
+    size_t size() const
+    {
+        return m_instructions.size();
+    }
+
+private:
+    std::unique_ptr<Arena> m_arena;
+    std::pmr::vector<Instruction<BFState> *> m_instructions;
+};
+
+template <class BFState>
+ArenaCode<BFState> parse_code(const std::string &code)
+{
+    // Pair the brackets up front so every instruction can be created in order
+    // with its target already known.
+    std::vector<size_t> match(code.length());
+    std::vector<size_t> brackets;
+    size_t count = 0;
+
+    for (char c : code)
+    {
+        if ('[' == c)
+        {
+            brackets.push_back(count);
+        }
+        else if (']' == c)
+        {
+            if (brackets.empty())
+            {
+                throw std::invalid_argument("unmatched ']'");
+            }
+            match[brackets.back()] = count;
+            match[count] = brackets.back();
+            brackets.pop_back();
+        }
+
+        if (is_bf_char(c))
+        {
+            ++count;
+        }
+    }
+
+    if (!brackets.empty())
+    {
+        throw std::invalid_argument("unmatched '['");
+    }
+
+    ArenaCode<BFState> ret;
+    ret.reserve(count);
+
+    for (char c : code)
+    {
+        switch (c)
+        {
+        case '+':
+            ret.template emplace<IncDataInstruction<BFState>>();
+            break;
+        case '-':
+            ret.template emplace<DecDataInstruction<BFState>>();
+            break;
+        case '>':
+            ret.template emplace<NextDataInstruction<BFState>>();
+            break;
+        case '<':
+            ret.template emplace<PrevDataInstruction<BFState>>();
+            break;
+        case '.':
+            ret.template emplace<OutInstruction<BFState, StdOutputter>>();
+            break;
+        case ',':
+            ret.template emplace<InInstruction<BFState>>();
+            break;
+        case '[':
+            ret.template emplace<JumpZeroInstruction<BFState>>(match[ret.size()]);
+            break;
+        case ']':
+            ret.template emplace<JumpNonzeroInstruction<BFState>>(match[ret.size()]);
+            break;
+        }
+    }
+    return ret;
+}
+
+template <
+    class BFState,
+    class Outputter = StdOutputter,
+    class Inputter = StdInputter>
+class FlyweightCode
+{
+public:
+    template <typename StringT>
+    FlyweightCode(
+        StringT code,
+        Outputter outputter = Outputter(),
+        Inputter inputter = Inputter())
+        : m_code(code),
+          m_arena(std::make_unique<Arena>()),
+          m_bracket_map(m_arena->resource()),
+          m_in(std::move(inputter)),
+          m_out(std::move(outputter))
+    {
+        build_bracket_map();
+    }
+
+    const Instruction<BFState> *operator[](size_t i) const
+    {
+        switch (m_code[i])
+        {
+        case '+':
+            return &m_inc;
+            break;
+        case '-':
+            return &m_dec;
+            break;
+        case '>':
+            return &m_next;
+            break;
+        case '<':
+            return &m_prev;
+            break;
+        case '.':
+            return &m_out;
+            break;
+        case ',':
+            return &m_in;
+            break;
+        case '[':
+        case ']':
+            return m_bracket_map.at(i);
+            break;
+        }
+        return nullptr;
+    }
+
+    size_t size() const
+    {
+        return m_code.length();
+    }
+
+private:
+    void build_bracket_map()
+    {
+        std::vector<size_t> bracket_stack;
+
+        for (size_t i = 0; i < m_code.length(); ++i)
+        {
+            if ('[' == m_code[i])
+            {
+                bracket_stack.push_back(i);
+            }
+            else if (']' == m_code[i])
+            {
+                if (bracket_stack.empty())
+                {
+                    throw std::invalid_argument("unmatched ']'");
+                }
+                size_t j = bracket_stack.back();
+                bracket_stack.pop_back();
+
+                m_bracket_map[j] = m_arena->create<JumpZeroInstruction<BFState>>(i);
+                m_bracket_map[i] = m_arena->create<JumpNonzeroInstruction<BFState>>(j);
+            }
+        }
+
+        if (!bracket_stack.empty())
+        {
+            throw std::invalid_argument("unmatched '['");
+        }
+    }
+
+    std::string m_code;
+    std::unique_ptr<Arena> m_arena;
+    std::pmr::map<size_t, Instruction<BFState> *> m_bracket_map;
+
+    IncDataInstruction<BFState> m_inc;
+    DecDataInstruction<BFState> m_dec;
+    NextDataInstruction<BFState> m_next;
+    PrevDataInstruction<BFState> m_prev;
+    InInstruction<BFState, Inputter> m_in;
+    OutInstruction<BFState, Outputter> m_out;
+};
+
+struct RunLimits
+{
+    uint64_t max_steps = UINT64_MAX;
+    size_t max_output = SIZE_MAX;
+    size_t tape_size = 0x2000;
+};
+
+enum class RunStatus
+{
+    Finished,
+    StepLimit,
+    OutputLimit,
+    TapeOverflow,
+    NonTerminating,
+};
+
+struct RunResult
+{
+    RunStatus status;
+    uint64_t steps;
+    // The record the run stopped at. For the flyweight engines that is an index
+    // into the filtered source, which SourceMap::filtered() maps back.
+    size_t program_counter = 0;
+};
+
+// Loops that provably never end once an iteration makes no progress. A loop is
+// watched when its body does no I/O, always comes back to the cell it started on
+// and writes at most max_cells cells. Between two back edges such a loop only
+// changes those cells, so if they and the data pointer are what they were at the
+// previous back edge the whole machine is, and it will go round forever. A loop
+// that never writes the cell it tests can't leave at all once it is taken.
+// Program counters index the filtered source, as in the flyweight engines.
+class LoopWatch
+{
+public:
+    static constexpr size_t max_cells = 8;
+
+    explicit LoopWatch(std::string_view code)
+        : m_ids(code.size(), -1)
+    {
+        std::vector<size_t> bracket_stack;
+        for (size_t i = 0; i < code.size(); ++i)
+        {
+            if ('[' == code[i])
+            {
+                bracket_stack.push_back(i);
+            }
+            else if (']' == code[i])
+            {
+                if (bracket_stack.empty())
+                {
+                    throw std::invalid_argument("unmatched ']'");
+                }
+                size_t j = bracket_stack.back();
+                bracket_stack.pop_back();
+                if (std::optional<Loop> loop = analyze(code.substr(j + 1, i - j - 1)))
+                {
+                    m_ids[i] = static_cast<int32_t>(m_loops.size());
+                    m_loops.push_back(*loop);
+                }
+            }
+        }
+
+        if (!bracket_stack.empty())
+        {
+            throw std::invalid_argument("unmatched '['");
+        }
+    }
+
+    size_t size() const
+    {
+        return m_loops.size();
+    }
+
+    // Fingerprints of the watched loops in one run.
+    class Tracker
+    {
+    public:
+        explicit Tracker(const LoopWatch *watch)
+            : m_watch(watch),
+              m_last(nullptr == watch ? 0 : watch->size())
+        {
+        }
+
+        // Called before the record at the program counter runs, true once the
+        // state is caught repeating at a back edge.
+        template <class BFState>
+        bool stuck(const BFState &state, size_t tape_size)
+        {
+            if (nullptr == m_watch || state.program_counter >= m_watch->m_ids.size())
+            {
+                return false;
+            }
+            int32_t id = m_watch->m_ids[state.program_counter];
+            if (id < 0)
+            {
+                return false;
+            }
+
+            Fingerprint &last = m_last[id];
+            if (0 == state.field[state.data_counter])
+            {
+                last.valid = false;
+                return false;
+            }
+
+            const Loop &loop = m_watch->m_loops[id];
+            if (!loop.writes_test)
+            {
+                return true;
+            }
+            Fingerprint now{state.data_counter, 0, true};
+            for (size_t k = 0; k < loop.count; ++k)
+            {
+                size_t cell = state.data_counter + loop.cells[k];
+                if (cell >= tape_size)
+                {
+                    return false;
+                }
+                now.cells = now.cells << 8 | state.field[cell];
+            }
+            bool same = last.valid && last.data_counter == now.data_counter && last.cells == now.cells;
+            last = now;
+            return same;
+        }
+
+    private:
+        struct Fingerprint
+        {
+            size_t data_counter = 0;
+            uint64_t cells = 0;
+            bool valid = false;
+        };
+
+        const LoopWatch *m_watch;
+        std::vector<Fingerprint> m_last;
+    };
+
+private:
+    struct Loop
+    {
+        // Cells the body writes, relative to the one tested.
+        std::array<int32_t, max_cells> cells;
+        uint8_t count;
+        bool writes_test;
+    };
+
+    static std::optional<Loop> analyze(std::string_view body)
+    {
+        Loop loop{{}, 0, false};
+        std::vector<int32_t> positions;
+        int32_t position = 0;
+        for (char c : body)
+        {
+            switch (c)
+            {
+            case '>':
+                ++position;
+                break;
+            case '<':
+                --position;
+                break;
+            case '.':
+            case ',':
+                return std::nullopt;
+            case '[':
+                positions.push_back(position);
+                break;
+            case ']':
+                if (positions.back() != position)
+                {
+                    return std::nullopt;
+                }
+                positions.pop_back();
+                break;
+            case '+':
+            case '-':
+                if (std::find(loop.cells.begin(), loop.cells.begin() + loop.count, position) ==
+                    loop.cells.begin() + loop.count)
+                {
+                    if (max_cells == loop.count)
+                    {
+                        return std::nullopt;
+                    }
+                    loop.cells[loop.count++] = position;
+                    loop.writes_test = loop.writes_test || 0 == position;
+                }
+                break;
+            }
+        }
+        if (0 != position)
+        {
+            return std::nullopt;
+        }
+        return loop;
+    }
+
+    std::vector<int32_t> m_ids;
+    std::vector<Loop> m_loops;
+};
+
+// Steps until the program ends or a limit is hit. output_full is asked after every
+// step, so the caller decides how output is counted. With loops given, a run caught
+// in one of the watched loops without making progress stops early.
+template <class BFInterpreter, class BFState, class OutputFull>
+RunResult execute_limited(
+    BFInterpreter &interpreter,
+    BFState &state,
+    const RunLimits &limits,
+    OutputFull output_full,
+    const LoopWatch *loops = nullptr)
+{
+    LoopWatch::Tracker tracker(loops);
+    uint64_t steps = 0;
+    while (!interpreter.finished(state))
+    {
+        if (steps == limits.max_steps)
+        {
+            return {RunStatus::StepLimit, steps, state.program_counter};
+        }
+        if (state.data_counter >= limits.tape_size)
+        {
+            return {RunStatus::TapeOverflow, steps, state.program_counter};
+        }
+        if (tracker.stuck(state, limits.tape_size))
+        {
+            return {RunStatus::NonTerminating, steps, state.program_counter};
+        }
+
+        interpreter.step(state);
+        ++steps;
+
+        if (output_full())
+        {
+            return {RunStatus::OutputLimit, steps, state.program_counter};
+        }
+    }
+    return {RunStatus::Finished, steps, state.program_counter};
+}
+
+// Runs a program entirely in memory: input comes from the span, output is appended
+// to the caller's buffer and nothing touches stdio.
+inline RunResult run(
+    std::string_view program,
+    std::span<const uint8_t> input,
+    std::vector<uint8_t> &output,
+    const RunLimits &limits = RunLimits())
+{
+    std::string code_string;
+    code_string.reserve(program.size());
+    std::copy_if(program.begin(), program.end(), std::back_inserter(code_string), is_bf_char);
+
+    BrainfuckState<size_t, size_t, TapePool::Lease> state{
+        0ull,
+        0ull,
+        default_tape_pool().acquire(limits.tape_size),
+    };
+
+    LoopWatch loops(code_string);
+    SpanInput span_input{input, 0};
+    auto code = FlyweightCode<decltype(state), VectorOutputter, SpanInputter>(
+        std::move(code_string),
+        VectorOutputter(&output),
+        SpanInputter(&span_input));
+
+    BrainfuckInterpreter<decltype(code), decltype(state)> interpreter(std::move(code));
+
+    size_t output_start = output.size();
+    RunResult result = execute_limited(interpreter, state, limits, [&]() {
+        return output.size() - output_start > limits.max_output;
+    }, &loops);
+    if (RunStatus::OutputLimit == result.status)
+    {
+        output.resize(output_start + limits.max_output);
+    }
+    return result;
+}
@@ -0,0 +1,255 @@
+#pragma once
+
+#include "bf.hpp"
+
+#include <array>
+
+// A tape made of reference counted pages. share() hands out a copy that points
+// at the same pages, and whichever side writes to a shared page first copies it.
+class CowTape
+{
+public:
+    static constexpr size_t page_bits = 12;
+    static constexpr size_t page_bytes = size_t(1) << page_bits;
+
+    using Page = std::array<uint8_t, page_bytes>;
+
+    explicit CowTape(size_t size)
+        : m_size(size),
+          m_pages((size + page_bytes - 1) >> page_bits, zero_page()),
+          m_owned(m_pages.size(), 0)
+    {
+    }
+
+    CowTape(CowTape &&) = default;
+    CowTape &operator=(CowTape &&) = default;
+
+    uint8_t &operator[](size_t i)
+    {
+        size_t page = i >> page_bits;
+        if (0 == m_owned[page])
+        {
+            m_pages[page] = std::make_shared<Page>(*m_pages[page]);
+            m_owned[page] = 1;
+        }
+        return (*m_pages[page])[i & (page_bytes - 1)];
+    }
+
+    const uint8_t &operator[](size_t i) const
+    {
+        return (*m_pages[i >> page_bits])[i & (page_bytes - 1)];
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    // Both this tape and the returned one have to copy a page before writing it.
+    CowTape share()
+    {
+        std::fill(m_owned.begin(), m_owned.end(), 0);
+        return CowTape(m_size, m_pages);
+    }
+
+private:
+    CowTape(size_t size, std::vector<std::shared_ptr<Page>> pages)
+        : m_size(size),
+          m_pages(std::move(pages)),
+          m_owned(m_pages.size(), 0)
+    {
+    }
+
+    static const std::shared_ptr<Page> &zero_page()
+    {
+        static const std::shared_ptr<Page> page = std::make_shared<Page>();
+        return page;
+    }
+
+    size_t m_size;
+    std::vector<std::shared_ptr<Page>> m_pages;
+    std::vector<uint8_t> m_owned;
+};
+
+struct CheckpointInput
+{
+    SpanInput input;
+    bool consumed;
+    bool hit_eof;
+};
+
+// Tells the runner when a byte was consumed, so it can checkpoint right after.
+class CheckpointInputter
+{
+public:
+    CheckpointInputter(CheckpointInput *input = nullptr)
+        : m_input(input)
+    {
+    }
+
+    uint8_t in() const
+    {
+        if (m_input->input.position >= m_input->input.data.size())
+        {
+            m_input->hit_eof = true;
+        }
+        else
+        {
+            m_input->consumed = true;
+        }
+        return SpanInputter(&m_input->input).in();
+    }
+
+private:
+    CheckpointInput *m_input;
+};
+
+// Runs one program over many inputs, checkpointing the state every time a byte
+// of input is consumed. Checkpoints live in a trie keyed by the consumed prefix,
+// and each run resumes from the deepest checkpoint its input matches, so only the
+// differing suffix is executed.
+class IncrementalRunner
+{
+public:
+    using State = BrainfuckState<size_t, size_t, CowTape>;
+    using Code = FlyweightCode<State, VectorOutputter, CheckpointInputter>;
+
+    IncrementalRunner(std::string code_string, size_t tape_size = 0x2000, size_t max_checkpoints = 1 << 16)
+        : m_loops(code_string),
+          m_interpreter(Code(std::move(code_string), VectorOutputter(&m_output), CheckpointInputter(&m_input))),
+          m_max_checkpoints(max_checkpoints)
+    {
+        m_root.checkpoint = std::make_unique<Checkpoint>(Checkpoint{State{0ull, 0ull, CowTape(tape_size)}, 0, {}});
+    }
+
+    IncrementalRunner(const IncrementalRunner &) = delete;
+    IncrementalRunner &operator=(const IncrementalRunner &) = delete;
+
+    RunResult run(std::span<const uint8_t> input, std::vector<uint8_t> &output, const RunLimits &limits = RunLimits())
+    {
+        // Walk down as far as the input matches, gathering the output on the way.
+        Node *deepest = &m_root;
+        size_t depth = 0;
+        m_output.clear();
+        m_output.insert(m_output.end(), m_root.checkpoint->output.begin(), m_root.checkpoint->output.end());
+        for (Node *node = &m_root; depth < input.size();)
+        {
+            auto it = node->children.find(input[depth]);
+            if (node->children.end() == it)
+            {
+                break;
+            }
+            node = it->second.get();
+            ++depth;
+            m_output.insert(m_output.end(), node->checkpoint->output.begin(), node->checkpoint->output.end());
+            deepest = node;
+        }
+        m_resumed_depth += depth;
+
+        Checkpoint &start = *deepest->checkpoint;
+        State state{start.state.data_counter, start.state.program_counter, start.state.field.share()};
+        m_input = CheckpointInput{SpanInput{input, depth}, false, false};
+
+        Node *node = deepest;
+        size_t output_mark = m_output.size();
+        uint64_t steps = start.steps;
+        RunStatus status = RunStatus::Finished;
+        LoopWatch::Tracker tracker(&m_loops);
+        while (!m_interpreter.finished(state))
+        {
+            if (steps == limits.max_steps)
+            {
+                status = RunStatus::StepLimit;
+                break;
+            }
+            if (state.data_counter >= limits.tape_size || state.data_counter >= state.field.size())
+            {
+                status = RunStatus::TapeOverflow;
+                break;
+            }
+            if (tracker.stuck(state, limits.tape_size))
+            {
+                status = RunStatus::NonTerminating;
+                break;
+            }
+
+            m_interpreter.step(state);
+            ++steps;
+
+            if (m_output.size() > limits.max_output)
+            {
+                status = RunStatus::OutputLimit;
+                break;
+            }
+
+            if (m_input.consumed)
+            {
+                m_input.consumed = false;
+                if (!m_input.hit_eof && m_checkpoints < m_max_checkpoints)
+                {
+                    node = add_checkpoint(node, input[m_input.input.position - 1], state, steps, output_mark);
+                    output_mark = m_output.size();
+                }
+            }
+        }
+
+        if (RunStatus::OutputLimit == status)
+        {
+            m_output.resize(limits.max_output);
+        }
+        output.insert(output.end(), m_output.begin(), m_output.end());
+        return {status, steps, state.program_counter};
+    }
+
+    size_t checkpoints() const
+    {
+        return m_checkpoints;
+    }
+
+    // Input bytes that were skipped by resuming, summed over every run so far.
+    uint64_t resumed_bytes() const
+    {
+        return m_resumed_depth;
+    }
+
+private:
+    struct Checkpoint
+    {
+        State state;
+        uint64_t steps;
+        // Only what was written since the parent checkpoint.
+        std::vector<uint8_t> output;
+    };
+
+    struct Node
+    {
+        std::unique_ptr<Checkpoint> checkpoint;
+        std::map<uint8_t, std::unique_ptr<Node>> children;
+    };
+
+    Node *add_checkpoint(Node *parent, uint8_t byte, State &state, uint64_t steps, size_t output_mark)
+    {
+        std::unique_ptr<Node> &child = parent->children[byte];
+        if (nullptr == child)
+        {
+            child = std::make_unique<Node>();
+            child->checkpoint = std::make_unique<Checkpoint>(Checkpoint{
+                State{state.data_counter, state.program_counter, state.field.share()},
+                steps,
+                std::vector<uint8_t>(m_output.begin() + output_mark, m_output.end()),
+            });
+            ++m_checkpoints;
+        }
+        return child.get();
+    }
+
+    std::vector<uint8_t> m_output;
+    CheckpointInput m_input{};
+    LoopWatch m_loops;
+    BrainfuckInterpreter<Code, State> m_interpreter;
+
+    Node m_root;
+    size_t m_checkpoints = 0;
+    size_t m_max_checkpoints;
+    uint64_t m_resumed_depth = 0;
+};
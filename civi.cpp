@@ -0,0 +1,158 @@
+#include "civi.h"
+#include "bf.hpp"
+
+namespace
+{
+    // Handles are shared between threads, so the current run's I/O is per thread
+    // rather than baked into the compiled instructions.
+    thread_local civi_io *t_io = nullptr;
+
+    // Bytes the current run may still write. A write past that is refused rather
+    // than delivered, and stops the run.
+    thread_local size_t t_output_room = 0;
+    thread_local bool t_output_refused = false;
+
+    class CInputter
+    {
+    public:
+        uint8_t in() const
+        {
+            if (nullptr != t_io->read)
+            {
+                return static_cast<uint8_t>(t_io->read(t_io->user));
+            }
+            if (0 == t_io->input_size)
+            {
+                return static_cast<uint8_t>(EOF);
+            }
+            t_io->input_size--;
+            return *t_io->input++;
+        }
+    };
+
+    class COutputter
+    {
+    public:
+        void out(uint8_t x) const
+        {
+            if (0 == t_output_room)
+            {
+                t_output_refused = true;
+                return;
+            }
+            t_output_room--;
+
+            if (nullptr != t_io->write)
+            {
+                t_io->write(t_io->user, x);
+            }
+            else
+            {
+                t_io->output[t_io->output_size] = x;
+            }
+            t_io->output_size++;
+        }
+    };
+
+    using CState = BrainfuckState<size_t, size_t, DirtyTrackingTape>;
+    using CCode = FlyweightCode<CState, COutputter, CInputter>;
+}
+
+struct civi_program
+{
+    LoopWatch loops;
+    BrainfuckInterpreter<CCode, CState> interpreter;
+};
+
+struct civi_state
+{
+    CState state;
+};
+
+civi_program *civi_compile(const char *source, size_t length)
+{
+    try
+    {
+        std::string code_string;
+        code_string.reserve(length);
+        std::copy_if(source, source + length, std::back_inserter(code_string), is_bf_char);
+
+        LoopWatch loops(code_string);
+        return new civi_program{std::move(loops), CCode(std::move(code_string))};
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void civi_free(civi_program *program)
+{
+    delete program;
+}
+
+civi_state *civi_state_new(size_t tape_size)
+{
+    try
+    {
+        return new civi_state{CState{0ull, 0ull, DirtyTrackingTape(tape_size)}};
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void civi_state_free(civi_state *state)
+{
+    delete state;
+}
+
+civi_status civi_run(
+    const civi_program *program,
+    civi_state *state,
+    civi_io *io,
+    const civi_limits *limits)
+{
+    RunLimits run_limits;
+    run_limits.tape_size = state->state.field.size();
+    if (nullptr != limits)
+    {
+        run_limits.max_steps = limits->max_steps;
+        run_limits.max_output = limits->max_output;
+    }
+    if (nullptr == io->write)
+    {
+        size_t room = io->output_capacity - std::min(io->output_size, io->output_capacity);
+        run_limits.max_output = std::min(run_limits.max_output, room);
+    }
+
+    try
+    {
+        t_io = io;
+        t_output_room = run_limits.max_output;
+        t_output_refused = false;
+        RunResult result = execute_limited(program->interpreter, state->state, run_limits, []() {
+            return t_output_refused;
+        }, &program->loops);
+        t_io = nullptr;
+
+        // The refused write still stepped past its '.', step back onto it so
+        // the next run starts by writing that byte.
+        if (t_output_refused)
+        {
+            state->state.program_counter--;
+        }
+        return static_cast<civi_status>(result.status);
+    }
+    catch (...)
+    {
+        t_io = nullptr;
+        return CIVI_ERROR;
+    }
+}
+
+void civi_reset(civi_state *state)
+{
+    reset(state->state);
+}
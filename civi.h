@@ -0,0 +1,74 @@
+#ifndef CIVI_H
+#define CIVI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CIVI_API __attribute__((visibility("default")))
+
+/* A compiled program. Immutable once compiled, so one handle can be shared
+ * between threads and runs. */
+typedef struct civi_program civi_program;
+
+/* A tape and its counters. Owned by one run at a time. */
+typedef struct civi_state civi_state;
+
+typedef enum civi_status
+{
+    CIVI_FINISHED = 0,
+    CIVI_STEP_LIMIT = 1,
+    CIVI_OUTPUT_LIMIT = 2,
+    CIVI_TAPE_OVERFLOW = 3,
+    /* Caught in a loop that provably never ends. */
+    CIVI_NON_TERMINATING = 4,
+    CIVI_ERROR = -1,
+} civi_status;
+
+/* Input is taken from read when it is set, otherwise from input/input_size.
+ * Output goes to write when it is set, otherwise into output, and output_size
+ * is updated to the number of bytes written. read returns -1 on EOF. */
+typedef struct civi_io
+{
+    const uint8_t *input;
+    size_t input_size;
+    uint8_t *output;
+    size_t output_capacity;
+    size_t output_size;
+
+    int (*read)(void *user);
+    void (*write)(void *user, uint8_t byte);
+    void *user;
+} civi_io;
+
+typedef struct civi_limits
+{
+    uint64_t max_steps;
+    size_t max_output;
+} civi_limits;
+
+/* Returns NULL if the source has unbalanced brackets or memory runs out. */
+CIVI_API civi_program *civi_compile(const char *source, size_t length);
+CIVI_API void civi_free(civi_program *program);
+
+CIVI_API civi_state *civi_state_new(size_t tape_size);
+CIVI_API void civi_state_free(civi_state *state);
+
+/* Continues from wherever the state is. limits may be NULL for no limits. */
+CIVI_API civi_status civi_run(
+    const civi_program *program,
+    civi_state *state,
+    civi_io *io,
+    const civi_limits *limits);
+
+/* Rewinds the state for a new run, clearing only the tape blocks that were touched. */
+CIVI_API void civi_reset(civi_state *state);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,67 @@
+#include "civi.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static int failed = 0;
+
+static void check(int ok, const char *name)
+{
+    fprintf(stderr, "%s %s\n", ok ? "ok  " : "FAIL", name);
+    failed += !ok;
+}
+
+/* Prints "ABCD", two bytes at a time into a buffer that only holds two. */
+static void check_resume_after_full_buffer(void)
+{
+    static const char source[] = "++++++++[>++++++++<-]>+.+.+.+.";
+    civi_program *program = civi_compile(source, strlen(source));
+    civi_state *state = civi_state_new(0x1000);
+
+    uint8_t buffer[2];
+    char printed[8] = {0};
+    civi_status status = CIVI_OUTPUT_LIMIT;
+    for (int run = 0; run < 3 && CIVI_OUTPUT_LIMIT == status; ++run)
+    {
+        civi_io io = {0};
+        io.output = buffer;
+        io.output_capacity = sizeof(buffer);
+        status = civi_run(program, state, &io, NULL);
+        strncat(printed, (const char *)buffer, io.output_size);
+    }
+
+    check(CIVI_FINISHED == status && 0 == strcmp(printed, "ABCD"), "resume after a full buffer");
+    civi_state_free(state);
+    civi_free(program);
+}
+
+static int written = 0;
+
+static void count_write(void *user, uint8_t byte)
+{
+    (void)user;
+    (void)byte;
+    written++;
+}
+
+static void check_output_limit_with_callback(void)
+{
+    civi_program *program = civi_compile("+[.]", 4);
+    civi_state *state = civi_state_new(0x1000);
+
+    civi_io io = {0};
+    io.write = count_write;
+    civi_limits limits = {1000, 3};
+    civi_status status = civi_run(program, state, &io, &limits);
+
+    check(CIVI_OUTPUT_LIMIT == status && 3 == written && 3 == io.output_size, "max_output bytes to a callback");
+    civi_state_free(state);
+    civi_free(program);
+}
+
+int main(void)
+{
+    check_resume_after_full_buffer();
+    check_output_limit_with_callback();
+    return 0 == failed ? 0 : 1;
+}
@@ -0,0 +1,626 @@
+#pragma once
+
+#include "optimizer.hpp"
+
+#include <array>
+#include <deque>
+#include <optional>
+#include <unordered_map>
+
+// Nodes of the closure engine. Small constants are baked into the type, so
+// AddN<3> or MoveN<-2> compile down to a single immediate operation.
+template <class BFState, int N>
+class AddN : public Instruction<BFState>
+{
+public:
+    virtual void execute(BFState &state) const final
+    {
+        state.field[state.data_counter] += N;
+    }
+};
+
+template <class BFState, int N>
+class MoveN : public Instruction<BFState>
+{
+public:
+    virtual void execute(BFState &state) const final
+    {
+        state.data_counter += N;
+    }
+};
+
+template <class BFState>
+class AddInstruction : public Instruction<BFState>
+{
+public:
+    AddInstruction(int n)
+        : m_n(n)
+    {
+    }
+
+    virtual void execute(BFState &state) const final
+    {
+        state.field[state.data_counter] += m_n;
+    }
+
+private:
+    int m_n;
+};
+
+template <class BFState>
+class MoveInstruction : public Instruction<BFState>
+{
+public:
+    MoveInstruction(ptrdiff_t n)
+        : m_n(n)
+    {
+    }
+
+    virtual void execute(BFState &state) const final
+    {
+        state.data_counter += m_n;
+    }
+
+private:
+    ptrdiff_t m_n;
+};
+
+template <class BFState>
+class SequenceInstruction : public Instruction<BFState>
+{
+public:
+    explicit SequenceInstruction(std::pmr::vector<const Instruction<BFState> *> body)
+        : m_body(std::move(body))
+    {
+    }
+
+    virtual void execute(BFState &state) const final
+    {
+        for (const Instruction<BFState> *instruction : m_body)
+        {
+            instruction->execute(state);
+        }
+    }
+
+private:
+    std::pmr::vector<const Instruction<BFState> *> m_body;
+};
+
+template <class BFState>
+class LoopInstruction : public Instruction<BFState>
+{
+public:
+    explicit LoopInstruction(const SequenceInstruction<BFState> *body)
+        : m_body(body)
+    {
+    }
+
+    virtual void execute(BFState &state) const final
+    {
+        while (0 != state.field[state.data_counter])
+        {
+            m_body->execute(state);
+        }
+    }
+
+private:
+    const SequenceInstruction<BFState> *m_body;
+};
+
+// A loop that does no I/O and whose body always comes back to the cell it tests,
+// touching nothing outside the window of width cells starting low cells from it.
+// Where it leaves the window depends only on what it found there, so the exit
+// window is remembered for every entry window the loop has run on. Loops that
+// keep missing are given up on for good, and the memo is state of the node, so
+// a memoizing engine runs one program at a time. The tape needs room for the
+// whole window.
+template <class BFState>
+class MemoLoopInstruction : public Instruction<BFState>
+{
+public:
+    static constexpr size_t max_window = 16;
+
+    MemoLoopInstruction(const LoopInstruction<BFState> *loop, int32_t low, size_t width, size_t tape_size)
+        : m_loop(loop),
+          m_low(low),
+          m_width(width),
+          m_tape_size(tape_size)
+    {
+    }
+
+    virtual void execute(BFState &state) const final
+    {
+        // The window may reach past where the loop itself goes, so near either
+        // end of the tape the loop just runs.
+        ptrdiff_t first = static_cast<ptrdiff_t>(state.data_counter) + m_low;
+        if (!m_enabled || 0 == state.field[state.data_counter] || first < 0 ||
+            static_cast<size_t>(first) + m_width > m_tape_size)
+        {
+            m_loop->execute(state);
+            return;
+        }
+
+        Window entry = window(state);
+        auto it = m_memo.find(entry);
+        bool hit = m_memo.end() != it;
+        if (hit)
+        {
+            for (size_t k = 0; k < m_width; ++k)
+            {
+                state.field[state.data_counter + m_low + k] = it->second[k];
+            }
+        }
+        else
+        {
+            m_loop->execute(state);
+            if (m_memo.size() < memo_capacity)
+            {
+                m_memo.emplace(entry, window(state));
+            }
+        }
+
+        m_hits += hit;
+        if (++m_lookups == memo_probe)
+        {
+            m_enabled = m_hits * 4 >= m_lookups;
+            m_lookups = 0;
+            m_hits = 0;
+            if (!m_enabled)
+            {
+                m_memo.clear();
+            }
+        }
+    }
+
+private:
+    using Window = std::array<uint8_t, max_window>;
+
+    // Lookups between checks of the hit rate, which has to stay at a quarter.
+    static constexpr size_t memo_probe = 256;
+    static constexpr size_t memo_capacity = 0x1000;
+
+    struct WindowHash
+    {
+        size_t operator()(const Window &window) const
+        {
+            uint64_t hash = 0xcbf29ce484222325ull;
+            for (uint8_t byte : window)
+            {
+                hash ^= byte;
+                hash *= 0x100000001b3ull;
+            }
+            return hash;
+        }
+    };
+
+    Window window(const BFState &state) const
+    {
+        Window cells{};
+        for (size_t k = 0; k < m_width; ++k)
+        {
+            cells[k] = state.field[state.data_counter + m_low + k];
+        }
+        return cells;
+    }
+
+    const LoopInstruction<BFState> *m_loop;
+    int32_t m_low;
+    size_t m_width;
+    size_t m_tape_size;
+    mutable std::unordered_map<Window, Window, WindowHash> m_memo;
+    mutable size_t m_lookups = 0;
+    mutable size_t m_hits = 0;
+    mutable bool m_enabled = true;
+};
+
+// Runs one of the optimizer's records through the shared packed implementation,
+// and the lowered original code after it when a guarded one falls back.
+template <class BFState>
+class ExtendedInstruction : public Instruction<BFState>
+{
+public:
+    ExtendedInstruction(const PackedInstruction *instruction, const Instruction<BFState> *fallback)
+        : m_instruction(instruction),
+          m_fallback(fallback)
+    {
+    }
+
+    virtual void execute(BFState &state) const final
+    {
+        size_t length = execute_extended(m_instruction, [&state](ptrdiff_t offset) -> uint8_t & {
+            return state.field[state.data_counter + offset];
+        });
+        if (nullptr != m_fallback && packed_length(m_instruction->opcode()) == length)
+        {
+            m_fallback->execute(state);
+        }
+    }
+
+private:
+    const PackedInstruction *m_instruction;
+    const Instruction<BFState> *m_fallback;
+};
+
+// A loop that is decoded the first time it is entered, and from then on runs
+// what that gave. The decoded node is state of this one, so a lazy engine runs
+// one program at a time.
+template <class BFState, class Decoder>
+class LazyLoopInstruction : public Instruction<BFState>
+{
+public:
+    explicit LazyLoopInstruction(Decoder decoder)
+        : m_decoder(std::move(decoder))
+    {
+    }
+
+    virtual void execute(BFState &state) const final
+    {
+        if (0 == state.field[state.data_counter])
+        {
+            return;
+        }
+        if (nullptr == m_decoded)
+        {
+            m_decoded = m_decoder();
+        }
+        m_decoded->execute(state);
+    }
+
+private:
+    Decoder m_decoder;
+    mutable const Instruction<BFState> *m_decoded = nullptr;
+};
+
+struct ClosureOptions
+{
+    // Wrap loops that qualify in a MemoLoopInstruction.
+    bool memoize = false;
+    // Decode loops on first entry and the top level a chunk at a time as it is
+    // reached, so nothing but the brackets is looked at up front.
+    bool lazy = false;
+    // With lazy set, run each loop of the program through the optimizer when it
+    // is first entered.
+    bool optimize_loops = false;
+    // Cells on the tape the program runs on, memoized windows stay inside them.
+    size_t tape_size = RunLimits().tape_size;
+};
+
+// Lowers a PackedProgram into a tree of the nodes above, allocated from one
+// arena: loops become nodes that run their body sequence, and straight-line code
+// becomes direct calls into pre-instantiated functors, with no dispatch switch.
+// Loops are hash-consed on their records, which are position independent, so
+// every copy of a loop is decoded once and shares one node.
+// Running from the start goes through the tree; anything else, like stepping
+// or resuming mid-program, falls back to the packed records.
+template <
+    class BFState,
+    class Outputter = StdOutputter,
+    class Inputter = StdInputter>
+class ClosureInterpreter : private Outputter, private Inputter
+{
+public:
+    ClosureInterpreter(
+        PackedProgram program,
+        Outputter outputter = Outputter(),
+        Inputter inputter = Inputter(),
+        ClosureOptions options = ClosureOptions())
+        : Outputter(outputter),
+          Inputter(inputter),
+          m_program(std::move(program)),
+          m_options(options),
+          m_arena(std::make_unique<Arena>()),
+          m_out(m_arena->create<OutInstruction<BFState, Outputter>>(std::move(outputter))),
+          m_in(m_arena->create<InInstruction<BFState, Inputter>>(std::move(inputter)))
+    {
+        if (!m_options.lazy)
+        {
+            m_root = lower(m_program.data(), m_program.data() + m_program.size(), true);
+            m_shared.clear();
+        }
+    }
+
+    // Lazy nodes point back at the engine.
+    ClosureInterpreter(const ClosureInterpreter &) = delete;
+    ClosureInterpreter &operator=(const ClosureInterpreter &) = delete;
+
+    // Loops decoded so far and how many distinct ones that took.
+    size_t loops() const
+    {
+        return m_loops;
+    }
+
+    size_t unique_loops() const
+    {
+        return m_unique_loops;
+    }
+
+    bool finished(const BFState &state) const
+    {
+        return state.program_counter >= m_program.size();
+    }
+
+    void step(BFState &state) const
+    {
+        execute_packed<BFState, Outputter, Inputter>(m_program[state.program_counter], state, *this, *this);
+        state.program_counter++;
+    }
+
+    void interpret(BFState &state) const
+    {
+        if (0 == state.program_counter)
+        {
+            if (!m_options.lazy)
+            {
+                m_root->execute(state);
+            }
+            for (size_t k = 0; m_options.lazy && !finished(state); ++k)
+            {
+                Chunk chunk = decode_chunk(k);
+                chunk.body->execute(state);
+                state.program_counter = chunk.end;
+            }
+            state.program_counter = m_program.size();
+            return;
+        }
+
+        while (!finished(state))
+        {
+            step(state);
+        }
+    }
+
+private:
+    using Factory = const Instruction<BFState> *(*)(Arena &);
+
+    static constexpr int small_constant = 8;
+    // Top-level records decoded at a time by a lazy engine, loops counting as one.
+    static constexpr size_t lazy_chunk = 0x1000;
+
+    template <template <class, int> class Node, int... Ns>
+    static constexpr std::array<Factory, sizeof...(Ns)> factories(std::integer_sequence<int, Ns...>)
+    {
+        return {{+[](Arena &arena) -> const Instruction<BFState> * {
+            return arena.create<Node<BFState, Ns - small_constant>>();
+        }...}};
+    }
+
+    static constexpr auto add_factories =
+        factories<AddN>(std::make_integer_sequence<int, 2 * small_constant + 1>());
+    static constexpr auto move_factories =
+        factories<MoveN>(std::make_integer_sequence<int, 2 * small_constant + 1>());
+
+    struct Chunk
+    {
+        size_t end;
+        const SequenceInstruction<BFState> *body;
+    };
+
+    // The k-th top-level chunk of a lazy engine, decoded when first asked for.
+    // Chunks are asked for in order.
+    Chunk decode_chunk(size_t k) const
+    {
+        if (k == m_chunks.size())
+        {
+            size_t begin = 0 == k ? 0 : m_chunks.back().end;
+            size_t end = begin;
+            for (size_t n = 0; n < lazy_chunk && end < m_program.size(); ++n)
+            {
+                const PackedInstruction &instruction = m_program[end];
+                Opcode opcode = instruction.opcode();
+                end += Opcode::JumpZero == opcode ? instruction.operand() + 1
+                                                  : packed_length(opcode) + fallback_length(&instruction);
+            }
+            m_chunks.push_back({end, lower(m_program.data() + begin, m_program.data() + end, false)});
+        }
+        return m_chunks[k];
+    }
+
+    // Lowers records [begin, end). Loops in records the optimizer has already
+    // seen are not run through it again.
+    const SequenceInstruction<BFState> *lower(
+        const PackedInstruction *begin,
+        const PackedInstruction *end,
+        bool optimized) const
+    {
+        std::pmr::vector<const Instruction<BFState> *> body(m_arena->resource());
+        for (const PackedInstruction *instruction = begin; instruction < end; ++instruction)
+        {
+            int32_t operand = instruction->operand();
+            switch (instruction->opcode())
+            {
+            case Opcode::Add:
+            {
+                int n = static_cast<int8_t>(operand);
+                body.push_back(std::abs(n) <= small_constant
+                                   ? add_factories[n + small_constant](*m_arena)
+                                   : m_arena->create<AddInstruction<BFState>>(n));
+                break;
+            }
+            case Opcode::Move:
+                body.push_back(std::abs(operand) <= small_constant
+                                   ? move_factories[operand + small_constant](*m_arena)
+                                   : m_arena->create<MoveInstruction<BFState>>(operand));
+                break;
+            case Opcode::In:
+                body.push_back(m_in);
+                break;
+            case Opcode::Out:
+                body.push_back(m_out);
+                break;
+            case Opcode::JumpZero:
+            {
+                const PackedInstruction *close = instruction + operand;
+                if (m_options.lazy)
+                {
+                    auto decoder = [this, instruction, close, optimized]() {
+                        return lower_loop(instruction + 1, close, optimized);
+                    };
+                    body.push_back(m_arena->create<LazyLoopInstruction<BFState, decltype(decoder)>>(decoder));
+                }
+                else
+                {
+                    body.push_back(lower_loop(instruction + 1, close, optimized));
+                }
+                instruction = close;
+                break;
+            }
+            case Opcode::JumpNonzero:
+                break;
+            default:
+            {
+                size_t length = packed_length(instruction->opcode());
+                size_t fallback = fallback_length(instruction);
+                body.push_back(m_arena->create<ExtendedInstruction<BFState>>(
+                    instruction,
+                    0 == fallback ? nullptr : lower(instruction + length, instruction + length + fallback, true)));
+                instruction += length + fallback - 1;
+                break;
+            }
+            }
+        }
+        return m_arena->create<SequenceInstruction<BFState>>(std::move(body));
+    }
+
+    // The window of cells around the tested one that the loop body [begin, end)
+    // can touch, as {low, width}, if the loop can be memoized: no I/O, every
+    // loop in it comes back to where it started and the window is small enough.
+    static std::optional<std::pair<int32_t, size_t>> memo_window(
+        const PackedInstruction *begin,
+        const PackedInstruction *end)
+    {
+        int32_t position = 0;
+        int32_t low = 0;
+        int32_t high = 0;
+        auto touch = [&](int32_t first, int32_t last) {
+            low = std::min(low, position + first);
+            high = std::max(high, position + last);
+        };
+        std::vector<int32_t> positions;
+        for (const PackedInstruction *instruction = begin; instruction < end; ++instruction)
+        {
+            int32_t operand = instruction->operand();
+            switch (instruction->opcode())
+            {
+            case Opcode::Add:
+                touch(0, 0);
+                break;
+            case Opcode::Move:
+                position += operand;
+                break;
+            case Opcode::JumpZero:
+                touch(0, 0);
+                positions.push_back(position);
+                break;
+            case Opcode::JumpNonzero:
+                if (positions.back() != position)
+                {
+                    return std::nullopt;
+                }
+                positions.pop_back();
+                break;
+            case Opcode::Set:
+                touch(operand, operand);
+                break;
+            case Opcode::MulAdd:
+            case Opcode::Eq:
+                touch(operand, operand);
+                touch(instruction[1].literal(), instruction[1].literal());
+                break;
+            case Opcode::WideAdd:
+                touch(operand, operand + instruction[1].literal() - 1);
+                break;
+            case Opcode::WideMulAdd:
+                touch(operand, operand + instruction[1].literal() - 1);
+                touch(instruction[2].literal(), instruction[2].literal());
+                break;
+            case Opcode::Lt:
+                touch(operand - 2, operand + 3);
+                break;
+            default:
+                return std::nullopt;
+            }
+            instruction += packed_length(instruction->opcode()) - 1;
+        }
+        size_t width = high - low + 1;
+        if (0 != position || width > MemoLoopInstruction<BFState>::max_window)
+        {
+            return std::nullopt;
+        }
+        return std::make_pair(low, width);
+    }
+
+    // The node for the loop with body [begin, end), shared with every loop
+    // decoded so far that has the same records. Loops the optimizer has seen
+    // are only shared among themselves, as what the optimizer makes of a loop
+    // usually holds that same loop again.
+    const Instruction<BFState> *lower_loop(
+        const PackedInstruction *begin,
+        const PackedInstruction *end,
+        bool optimized) const
+    {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (const PackedInstruction *instruction = begin; instruction < end; ++instruction)
+        {
+            hash ^= static_cast<uint32_t>(instruction->literal());
+            hash *= 0x100000001b3ull;
+        }
+
+        ++m_loops;
+        std::vector<SharedLoop> &candidates = m_shared[hash];
+        for (const SharedLoop &candidate : candidates)
+        {
+            auto same = [](const PackedInstruction &a, const PackedInstruction &b) {
+                return a.literal() == b.literal();
+            };
+            if (optimized == candidate.optimized && std::equal(begin, end, candidate.begin, candidate.end, same))
+            {
+                return candidate.loop;
+            }
+        }
+
+        ++m_unique_loops;
+        const Instruction<BFState> *loop;
+        if (m_options.optimize_loops && !optimized)
+        {
+            // Jumps are relative, so the loop's records with its brackets are a
+            // program of their own.
+            PackedProgram code(std::vector<PackedInstruction>(begin - 1, end + 1));
+            const PackedProgram &lowered = m_optimized.emplace_back(optimize(code, false));
+            loop = lower(lowered.data(), lowered.data() + lowered.size(), true);
+        }
+        else
+        {
+            loop = m_arena->create<LoopInstruction<BFState>>(lower(begin, end, optimized));
+            if (auto window = m_options.memoize ? memo_window(begin, end) : std::nullopt)
+            {
+                loop = m_arena->create<MemoLoopInstruction<BFState>>(
+                    static_cast<const LoopInstruction<BFState> *>(loop), window->first, window->second,
+                    m_options.tape_size);
+            }
+        }
+        candidates.push_back({begin, end, optimized, loop});
+        return loop;
+    }
+
+    struct SharedLoop
+    {
+        const PackedInstruction *begin;
+        const PackedInstruction *end;
+        bool optimized;
+        const Instruction<BFState> *loop;
+    };
+
+    PackedProgram m_program;
+    ClosureOptions m_options;
+    std::unique_ptr<Arena> m_arena;
+    const OutInstruction<BFState, Outputter> *m_out;
+    const InInstruction<BFState, Inputter> *m_in;
+    const SequenceInstruction<BFState> *m_root = nullptr;
+    // Loops decoded so far by the hash of their records, kept while decoding goes on.
+    mutable std::unordered_map<uint64_t, std::vector<SharedLoop>> m_shared;
+    mutable std::vector<Chunk> m_chunks;
+    // Loops as the optimizer rewrote them, which decoded nodes point into.
+    mutable std::deque<PackedProgram> m_optimized;
+    mutable size_t m_loops = 0;
+    mutable size_t m_unique_loops = 0;
+};
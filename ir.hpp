@@ -0,0 +1,388 @@
+#pragma once
+
+#include "packed.hpp"
+
+enum class IrOp : uint8_t
+{
+    Add,
+    Move,
+    In,
+    Out,
+    Loop,
+    Set,
+    MulAdd,
+    WideAdd,
+    WideMulAdd,
+    Eq,
+    Lt,
+    DivMod,
+};
+
+struct IrNode;
+using IrBlock = std::pmr::vector<IrNode>;
+
+// Cell offsets are relative to the frame of the block: the data pointer at its
+// start, shifted by every Move and reset to the data pointer after every
+// unbalanced loop. A balanced loop, one whose body always comes back to where it
+// started, shares the frame of the block it sits in, so the optimizer can see
+// straight through it.
+struct IrNode
+{
+    IrOp op;
+    // The cell the node works on, for loops the cell tested and for Lt the
+    // temporary its operands sit around.
+    int32_t offset = 0;
+    // Add amount, Set value, MulAdd or WideMulAdd factor, WideAdd delta or Move
+    // distance.
+    int32_t value = 0;
+    // MulAdd or WideMulAdd source cell, WideAdd width in cells or Eq right-hand cell.
+    int32_t operand = 0;
+    // Loop body, or the original loop a DivMod falls back on.
+    IrBlock *body = nullptr;
+    bool balanced = false;
+    // The record of the program the IR was built from that the node stands
+    // for, the open bracket for loops, so emit() can say where its records came from.
+    uint32_t origin = 0;
+    // WideMulAdd width in cells.
+    int32_t width = 0;
+
+    bool is_straight() const
+    {
+        return IrOp::Add == op || IrOp::Set == op;
+    }
+
+    // Whether running the node may read or write the cell at offset. A balanced
+    // loop only touches what its body does, an unbalanced one anything.
+    bool touches(int32_t cell) const
+    {
+        switch (op)
+        {
+        case IrOp::Loop:
+            return !balanced || cell == offset ||
+                   std::any_of(body->begin(), body->end(), [cell](const IrNode &node) { return node.touches(cell); });
+        case IrOp::Add:
+        case IrOp::Set:
+        case IrOp::In:
+        case IrOp::Out:
+            return cell == offset;
+        case IrOp::MulAdd:
+        case IrOp::Eq:
+            return cell == offset || cell == operand;
+        case IrOp::WideAdd:
+            return cell >= offset && cell < offset + operand;
+        case IrOp::WideMulAdd:
+            return (cell >= offset && cell < offset + width) || cell == operand;
+        case IrOp::Lt:
+            return cell >= offset - 2 && cell <= offset + 3;
+        default:
+            return true;
+        }
+    }
+};
+
+// A program as a tree of blocks, everything allocated from one arena. Built from
+// a PackedProgram, rewritten by the optimizer passes and lowered back into one.
+class IrProgram
+{
+public:
+    explicit IrProgram(const PackedProgram &program)
+        : m_arena(std::make_unique<Arena>()),
+          m_root(new_block())
+    {
+        build(*m_root, program, 0, program.size());
+    }
+
+    IrProgram(const IrProgram &) = delete;
+    IrProgram &operator=(const IrProgram &) = delete;
+
+    IrBlock &root()
+    {
+        return *m_root;
+    }
+
+    const IrBlock &root() const
+    {
+        return *m_root;
+    }
+
+    IrBlock *new_block()
+    {
+        return m_arena->create<IrBlock>(m_arena->resource());
+    }
+
+    // With origins given, it gets the origin of the node behind every record.
+    PackedProgram emit(std::vector<uint32_t> *origins = nullptr) const
+    {
+        Emitter emitter;
+        emitter.origins = origins;
+        emitter.emit(*m_root);
+        emitter.move_to(0);
+        emitter.claim(emitter.origin);
+        return PackedProgram(std::move(emitter.code));
+    }
+
+    // A deep copy of the block, loop bodies included.
+    IrBlock *clone(const IrBlock &block)
+    {
+        IrBlock *copy = new_block();
+        copy->reserve(block.size());
+        for (const IrNode &node : block)
+        {
+            copy->push_back(node);
+            if (nullptr != node.body)
+            {
+                copy->back().body = clone(*node.body);
+            }
+        }
+        return copy;
+    }
+
+    // Moves a balanced body into a frame that starts delta cells further on.
+    static void shift(IrBlock &block, int32_t delta)
+    {
+        for (IrNode &node : block)
+        {
+            node.offset += delta;
+            if (IrOp::MulAdd == node.op || IrOp::WideMulAdd == node.op || IrOp::Eq == node.op)
+            {
+                node.operand += delta;
+            }
+            else if (IrOp::Loop == node.op)
+            {
+                shift(*node.body, delta);
+            }
+        }
+    }
+
+private:
+    // Whether the records at program[at] are those of the idiom.
+    static bool matches(const PackedProgram &program, size_t at, const PackedProgram &idiom)
+    {
+        return program.size() - at >= idiom.size() &&
+               std::equal(idiom.data(), idiom.data() + idiom.size(), program.data() + at,
+                          [](const PackedInstruction &a, const PackedInstruction &b) {
+                              return a.literal() == b.literal();
+                          });
+    }
+
+    // Fills the block from program records [begin, end), true if it is balanced.
+    bool build(IrBlock &block, const PackedProgram &program, size_t begin, size_t end)
+    {
+        // The wiki's divmod and x < y, which walk the tape with unbalanced loops
+        // of their own but come back to where they started. Only this layout of
+        // their cells is recognized.
+        static const PackedProgram divmod("[->+>-[>+>>]>[+[-<+>]>+>>]<<<<<<]");
+        static const PackedProgram less("[-]>[-]>[-]+>[-]<<<<[>+>+<<-]>[<+>-]<<[>>+<<-]+>>>[>-]>[<<<<->>[-]>>->]<+<<"
+                                        "[>-[>-]>[<<<<->>[-]+>>->]<+<<-]");
+
+        int32_t position = 0;
+        bool known = true;
+        for (size_t i = begin; i < end; ++i)
+        {
+            const PackedInstruction &instruction = program[i];
+            auto push = [&block, i](IrNode node) {
+                node.origin = static_cast<uint32_t>(i);
+                block.push_back(node);
+            };
+            if (matches(program, i, less))
+            {
+                push({IrOp::Lt, position});
+                i += less.size() - 1;
+                continue;
+            }
+            if (matches(program, i, divmod))
+            {
+                // The loop itself stays behind as the fallback, and with it the
+                // frame reset, since it need not come back when the guard fails.
+                if (0 != position)
+                {
+                    push({IrOp::Move, 0, position});
+                }
+                position = 0;
+                known = false;
+                IrBlock *body = new_block();
+                IrBlock *fallback = new_block();
+                build(*body, program, i + 1, i + divmod.size() - 1);
+                fallback->push_back({IrOp::Loop, 0, 0, 0, body, false, static_cast<uint32_t>(i)});
+                push({IrOp::DivMod, 0, 0, 0, fallback, false});
+                i += divmod.size() - 1;
+                continue;
+            }
+            switch (instruction.opcode())
+            {
+            case Opcode::Add:
+                push({IrOp::Add, position, static_cast<int8_t>(instruction.operand())});
+                break;
+            case Opcode::Move:
+                position += instruction.operand();
+                break;
+            case Opcode::In:
+                push({IrOp::In, position});
+                break;
+            case Opcode::Out:
+                push({IrOp::Out, position});
+                break;
+            case Opcode::JumpZero:
+            {
+                IrBlock *body = new_block();
+                size_t close = i + instruction.operand();
+                if (build(*body, program, i + 1, close))
+                {
+                    shift(*body, position);
+                    push({IrOp::Loop, position, 0, 0, body, true});
+                }
+                else
+                {
+                    if (0 != position)
+                    {
+                        push({IrOp::Move, 0, position});
+                    }
+                    position = 0;
+                    known = false;
+                    push({IrOp::Loop, 0, 0, 0, body, false});
+                }
+                i = close;
+                break;
+            }
+            default:
+                throw std::invalid_argument("program is already optimized");
+            }
+        }
+
+        if (0 != position)
+        {
+            uint32_t last = static_cast<uint32_t>(end > begin ? end - 1 : begin);
+            block.push_back({IrOp::Move, 0, position, 0, nullptr, false, last});
+        }
+        return known && 0 == position;
+    }
+
+    struct Emitter
+    {
+        std::vector<uint32_t> *origins = nullptr;
+        std::vector<PackedInstruction> code;
+        // Where the data pointer is, relative to the current frame.
+        int32_t ptr = 0;
+        // The node being emitted.
+        uint32_t origin = 0;
+
+        // Records emitted since the last claim came from the node at origin.
+        void claim(uint32_t origin)
+        {
+            if (nullptr != origins)
+            {
+                origins->resize(code.size(), origin);
+            }
+        }
+
+        void move_to(int32_t offset)
+        {
+            if (offset != ptr)
+            {
+                code.emplace_back(Opcode::Move, offset - ptr);
+                ptr = offset;
+            }
+        }
+
+        void emit(const IrBlock &block)
+        {
+            for (const IrNode &node : block)
+            {
+                claim(origin);
+                origin = node.origin;
+                switch (node.op)
+                {
+                case IrOp::Add:
+                    move_to(node.offset);
+                    code.emplace_back(Opcode::Add, node.value & 0xff);
+                    break;
+                case IrOp::Move:
+                    ptr -= node.value;
+                    break;
+                case IrOp::In:
+                    move_to(node.offset);
+                    code.emplace_back(Opcode::In);
+                    break;
+                case IrOp::Out:
+                    move_to(node.offset);
+                    code.emplace_back(Opcode::Out);
+                    break;
+                case IrOp::Set:
+                    code.emplace_back(Opcode::Set, node.offset - ptr);
+                    code.push_back(PackedInstruction::literal(node.value));
+                    break;
+                case IrOp::MulAdd:
+                    code.emplace_back(Opcode::MulAdd, node.offset - ptr);
+                    code.push_back(PackedInstruction::literal(node.operand - ptr));
+                    code.push_back(PackedInstruction::literal(node.value));
+                    break;
+                case IrOp::WideAdd:
+                    code.emplace_back(Opcode::WideAdd, node.offset - ptr);
+                    code.push_back(PackedInstruction::literal(node.operand));
+                    code.push_back(PackedInstruction::literal(node.value));
+                    break;
+                case IrOp::WideMulAdd:
+                    code.emplace_back(Opcode::WideMulAdd, node.offset - ptr);
+                    code.push_back(PackedInstruction::literal(node.width));
+                    code.push_back(PackedInstruction::literal(node.operand - ptr));
+                    code.push_back(PackedInstruction::literal(node.value));
+                    break;
+                case IrOp::Eq:
+                    code.emplace_back(Opcode::Eq, node.offset - ptr);
+                    code.push_back(PackedInstruction::literal(node.operand - ptr));
+                    break;
+                case IrOp::Lt:
+                    code.emplace_back(Opcode::Lt, node.offset - ptr);
+                    break;
+                case IrOp::DivMod:
+                {
+                    // The fallback starts and ends on the frame origin.
+                    move_to(0);
+                    size_t guard = code.size();
+                    code.emplace_back(Opcode::DivMod);
+                    code.push_back(PackedInstruction::literal(0));
+                    claim(node.origin);
+                    emit(*node.body);
+                    claim(origin);
+                    origin = node.origin;
+                    code[guard + 1] = PackedInstruction::literal(static_cast<int32_t>(code.size() - guard - 2));
+                    break;
+                }
+                case IrOp::Loop:
+                {
+                    move_to(node.offset);
+                    size_t open = code.size();
+                    code.emplace_back(Opcode::JumpZero);
+                    claim(node.origin);
+                    if (node.balanced)
+                    {
+                        emit(*node.body);
+                        claim(origin);
+                        origin = node.origin;
+                        move_to(node.offset);
+                    }
+                    else
+                    {
+                        ptr = 0;
+                        emit(*node.body);
+                        claim(origin);
+                        origin = node.origin;
+                        move_to(0);
+                    }
+                    int32_t distance = PackedProgram::distance(open, code.size());
+                    code[open] = PackedInstruction(Opcode::JumpZero, distance);
+                    code.emplace_back(Opcode::JumpNonzero, -distance);
+                    if (!node.balanced)
+                    {
+                        ptr = 0;
+                    }
+                    break;
+                }
+                }
+            }
+        }
+    };
+
+    std::unique_ptr<Arena> m_arena;
+    IrBlock *m_root;
+};
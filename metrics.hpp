@@ -0,0 +1,225 @@
+#pragma once
+
+#include "bf.hpp"
+
+#include <chrono>
+#include <fstream>
+
+// Counters for the runs on the current thread. Only the owning thread touches
+// them, so the counting policies below get away with plain increments.
+struct RunMetrics
+{
+    uint64_t instructions = 0;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    size_t peak_tape_offset = 0;
+};
+
+inline thread_local RunMetrics t_run_metrics;
+
+class MetricsWriter;
+inline thread_local MetricsWriter *t_metrics_writer = nullptr;
+
+// Writes the current thread's counters as a Prometheus textfile for node-exporter.
+// The file is replaced through a rename so a scrape never sees half of it.
+class MetricsWriter
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    MetricsWriter(std::string path, std::chrono::seconds interval = std::chrono::seconds(10))
+        : m_path(std::move(path)),
+          m_interval(interval),
+          m_phase_start(clock::now()),
+          m_last_write(m_phase_start)
+    {
+    }
+
+    // Closes the running phase and starts timing the next one.
+    void phase(const char *name)
+    {
+        clock::time_point now = clock::now();
+        if (nullptr != m_phase)
+        {
+            m_phases.emplace_back(m_phase, std::chrono::duration<double>(now - m_phase_start).count());
+        }
+        m_phase = name;
+        m_phase_start = now;
+    }
+
+    void maybe_write()
+    {
+        if (clock::now() - m_last_write >= m_interval)
+        {
+            write(nullptr);
+        }
+    }
+
+    void finish(int exit_status)
+    {
+        phase(nullptr);
+        write(&exit_status);
+    }
+
+private:
+    void write(const int *exit_status)
+    {
+        m_last_write = clock::now();
+
+        double execution_seconds = 0;
+        for (const auto &[name, seconds] : m_phases)
+        {
+            if (0 == std::strcmp(name, "execution"))
+            {
+                execution_seconds += seconds;
+            }
+        }
+        if (nullptr != m_phase && 0 == std::strcmp(m_phase, "execution"))
+        {
+            execution_seconds += std::chrono::duration<double>(m_last_write - m_phase_start).count();
+        }
+
+        const RunMetrics &metrics = t_run_metrics;
+        std::string temporary_path = m_path + ".tmp";
+        {
+            std::ofstream out(temporary_path, std::ios::trunc);
+
+            out << "# HELP civi_instructions_total Instructions executed.\n"
+                << "# TYPE civi_instructions_total counter\n"
+                << "civi_instructions_total " << metrics.instructions << "\n";
+
+            out << "# HELP civi_instructions_per_second Instructions executed per second of execution.\n"
+                << "# TYPE civi_instructions_per_second gauge\n"
+                << "civi_instructions_per_second "
+                << (execution_seconds > 0 ? metrics.instructions / execution_seconds : 0) << "\n";
+
+            out << "# HELP civi_input_bytes_total Bytes read by the program.\n"
+                << "# TYPE civi_input_bytes_total counter\n"
+                << "civi_input_bytes_total " << metrics.bytes_in << "\n";
+
+            out << "# HELP civi_output_bytes_total Bytes written by the program.\n"
+                << "# TYPE civi_output_bytes_total counter\n"
+                << "civi_output_bytes_total " << metrics.bytes_out << "\n";
+
+            out << "# HELP civi_phase_seconds Time spent in each phase of the run.\n"
+                << "# TYPE civi_phase_seconds gauge\n";
+            for (const auto &[name, seconds] : m_phases)
+            {
+                out << "civi_phase_seconds{phase=\"" << name << "\"} " << seconds << "\n";
+            }
+
+            out << "# HELP civi_peak_tape_offset Highest tape cell the program moved to.\n"
+                << "# TYPE civi_peak_tape_offset gauge\n"
+                << "civi_peak_tape_offset " << metrics.peak_tape_offset << "\n";
+
+            out << "# HELP civi_running Whether the run is still in progress.\n"
+                << "# TYPE civi_running gauge\n"
+                << "civi_running " << (nullptr == exit_status ? 1 : 0) << "\n";
+
+            if (nullptr != exit_status)
+            {
+                out << "# HELP civi_exit_status How the run ended, 0 when it finished and a RunStatus otherwise.\n"
+                    << "# TYPE civi_exit_status gauge\n"
+                    << "civi_exit_status " << *exit_status << "\n";
+            }
+        }
+        std::rename(temporary_path.c_str(), m_path.c_str());
+    }
+
+    std::string m_path;
+    std::chrono::seconds m_interval;
+    const char *m_phase = nullptr;
+    clock::time_point m_phase_start;
+    clock::time_point m_last_write;
+    std::vector<std::pair<const char *, double>> m_phases;
+};
+
+constexpr uint64_t metrics_check_mask = (1 << 20) - 1;
+
+// Counts steps, the interpreter bumps the program counter exactly once per step.
+// Every million or so steps it gives the writer a chance to refresh the file.
+class CountingProgramCounter
+{
+public:
+    CountingProgramCounter(size_t pc = 0)
+        : m_pc(pc)
+    {
+    }
+
+    size_t operator++(int)
+    {
+        if (0 == (++t_run_metrics.instructions & metrics_check_mask) && nullptr != t_metrics_writer)
+        {
+            t_metrics_writer->maybe_write();
+        }
+        return m_pc++;
+    }
+
+    operator size_t() const
+    {
+        return m_pc;
+    }
+
+private:
+    size_t m_pc;
+};
+
+class PeakDataCounter
+{
+public:
+    PeakDataCounter(size_t dc = 0)
+        : m_dc(dc)
+    {
+    }
+
+    size_t operator++(int)
+    {
+        t_run_metrics.peak_tape_offset = std::max(t_run_metrics.peak_tape_offset, m_dc + 1);
+        return m_dc++;
+    }
+
+    size_t operator--(int)
+    {
+        return m_dc--;
+    }
+
+    operator size_t() const
+    {
+        return m_dc;
+    }
+
+private:
+    size_t m_dc;
+};
+
+template <class Inputter>
+class CountingInputter : private Inputter
+{
+public:
+    CountingInputter(Inputter inputter = Inputter())
+        : Inputter(std::move(inputter))
+    {
+    }
+
+    uint8_t in() const
+    {
+        t_run_metrics.bytes_in++;
+        return Inputter::in();
+    }
+};
+
+template <class Outputter>
+class CountingOutputter : private Outputter
+{
+public:
+    CountingOutputter(Outputter outputter = Outputter())
+        : Outputter(std::move(outputter))
+    {
+    }
+
+    void out(uint8_t x) const
+    {
+        t_run_metrics.bytes_out++;
+        Outputter::out(x);
+    }
+};
@@ -0,0 +1,863 @@
+#pragma once
+
+#include "ir.hpp"
+
+#include <optional>
+
+// Multiplicative inverse of an odd byte modulo 256, by Newton's iteration.
+inline uint8_t inverse_mod256(uint8_t d)
+{
+    uint8_t inverse = d;
+    for (int i = 0; i < 3; ++i)
+    {
+        inverse *= 2 - d * inverse;
+    }
+    return inverse;
+}
+
+// Index of the last node in block[0, end) that may touch the cell, or SIZE_MAX.
+// Loops and moves count as touching everything.
+inline size_t last_touching(const IrBlock &block, size_t end, int32_t cell)
+{
+    while (0 != end)
+    {
+        if (block[--end].touches(cell))
+        {
+            return end;
+        }
+    }
+    return SIZE_MAX;
+}
+
+// Turns balanced loops made only of Adds, where the tested cell steps by an odd
+// amount, into their closed form: [->+++<] becomes cell[1] += 3 * cell[0] and
+// cell[0] = 0. An odd step always reaches zero, after -cell * step^-1 iterations.
+inline void lower_simple_loops(IrBlock &block)
+{
+    IrBlock lowered(block.get_allocator());
+    lowered.reserve(block.size());
+    for (IrNode &node : block)
+    {
+        bool simple = IrOp::Loop == node.op && node.balanced;
+        uint8_t step = 0;
+        for (size_t i = 0; simple && i < node.body->size(); ++i)
+        {
+            const IrNode &inner = (*node.body)[i];
+            simple = IrOp::Add == inner.op;
+            step += node.offset == inner.offset ? inner.value : 0;
+        }
+        if (!simple || 0 == (step & 1))
+        {
+            lowered.push_back(node);
+            continue;
+        }
+
+        uint8_t per_unit = -inverse_mod256(step);
+        size_t first = lowered.size();
+        for (const IrNode &inner : *node.body)
+        {
+            if (node.offset == inner.offset)
+            {
+                continue;
+            }
+            auto it = std::find_if(lowered.begin() + first, lowered.end(), [&](const IrNode &other) {
+                return other.offset == inner.offset;
+            });
+            if (lowered.end() == it)
+            {
+                lowered.push_back({IrOp::MulAdd, inner.offset, 0, node.offset, nullptr, false, node.origin});
+                it = lowered.end() - 1;
+            }
+            it->value = static_cast<int8_t>(it->value + inner.value * per_unit);
+        }
+        lowered.erase(std::remove_if(lowered.begin() + first, lowered.end(), [](const IrNode &other) {
+                          return 0 == other.value;
+                      }),
+                      lowered.end());
+        lowered.push_back({IrOp::Set, node.offset, 0, 0, nullptr, false, node.origin});
+    }
+    block.swap(lowered);
+}
+
+// Merges each Add and WideAdd into the last earlier node on the same cells when
+// nothing in between reads or writes them: adds sum up and a set absorbs the
+// adds after it.
+inline void fold_adds(IrBlock &block)
+{
+    IrBlock folded(block.get_allocator());
+    folded.reserve(block.size());
+    for (const IrNode &node : block)
+    {
+        size_t j = IrOp::Add == node.op || IrOp::WideAdd == node.op
+                       ? last_touching(folded, folded.size(), node.offset)
+                       : SIZE_MAX;
+        IrNode *earlier = SIZE_MAX == j ? nullptr : &folded[j];
+        if (nullptr == earlier || earlier->offset != node.offset)
+        {
+            folded.push_back(node);
+        }
+        else if (IrOp::Add == node.op && IrOp::Set == earlier->op)
+        {
+            earlier->value = static_cast<uint8_t>(earlier->value + node.value);
+        }
+        else if (IrOp::Add == node.op && IrOp::Add == earlier->op)
+        {
+            earlier->value = static_cast<int8_t>(earlier->value + node.value);
+            if (0 == earlier->value)
+            {
+                folded.erase(folded.begin() + j);
+            }
+        }
+        else if (IrOp::WideAdd == node.op && IrOp::WideAdd == earlier->op && earlier->operand == node.operand &&
+                 std::abs(int64_t(earlier->value) + node.value) <= INT32_MAX)
+        {
+            // Every cell of the group has to be free in between, not just the first.
+            bool clear = true;
+            for (int32_t cell = node.offset + 1; cell < node.offset + node.operand; ++cell)
+            {
+                clear = clear && last_touching(folded, folded.size(), cell) == j;
+            }
+            if (clear)
+            {
+                earlier->value += node.value;
+            }
+            else
+            {
+                folded.push_back(node);
+            }
+        }
+        else
+        {
+            folded.push_back(node);
+        }
+    }
+    block.swap(folded);
+}
+
+// Drops an Add or Set whose cell is set again before anything reads it.
+inline void eliminate_dead_stores(IrBlock &block)
+{
+    IrBlock live(block.get_allocator());
+    live.reserve(block.size());
+    for (const IrNode &node : block)
+    {
+        size_t j = IrOp::Set == node.op ? last_touching(live, live.size(), node.offset) : SIZE_MAX;
+        if (SIZE_MAX != j && live[j].is_straight() && live[j].offset == node.offset)
+        {
+            live.erase(live.begin() + j);
+        }
+        live.push_back(node);
+    }
+    block.swap(live);
+}
+
+struct WideMatch
+{
+    size_t end;
+    int32_t offset;
+    int32_t width;
+    int32_t flag;
+    int32_t scratch;
+};
+
+// Matches a multi-byte increment (direction 1) or decrement (-1) starting at
+// block[begin]. The carry is the esolang wiki's "if x == 0" with two scratch
+// cells, flag and scratch, reused by every level, after the passes above:
+//
+//     increment            x+ flag[-]+ scratch[-] x[flag- x[scratch+x-]] scratch[x+scratch-] flag[- y+ carry(y)]
+//     decrement            flag[-]+ scratch[-] x[flag- x[scratch+x-]] scratch[x+scratch-] flag[- borrow(y) y-] x-
+//
+// where y is the cell after x and the innermost level is just flag[- y+] or
+// flag[- y-]. Both scratch cells always end up zero. Bodies are optimized before
+// the loops around them, so carry(y) has already become a WideAdd on y.
+inline std::optional<WideMatch> match_wide(const IrBlock &block, size_t begin, int direction)
+{
+    size_t loop = begin;
+    while (loop < block.size() && block[loop].is_straight())
+    {
+        ++loop;
+    }
+    if (loop == block.size() || IrOp::Loop != block[loop].op || !block[loop].balanced ||
+        loop - begin != (direction > 0 ? 3u : 2u))
+    {
+        return std::nullopt;
+    }
+
+    // x[flag- x[scratch+x-]] after lowering.
+    int32_t x = block[loop].offset;
+    const IrBlock &test = *block[loop].body;
+    if (3 != test.size() || IrOp::Set != test[2].op || x != test[2].offset || 0 != test[2].value)
+    {
+        return std::nullopt;
+    }
+    const IrNode *decrement = &test[0];
+    const IrNode *copy = &test[1];
+    if (IrOp::MulAdd == decrement->op)
+    {
+        std::swap(decrement, copy);
+    }
+    if (IrOp::Add != decrement->op || -1 != decrement->value || IrOp::MulAdd != copy->op ||
+        x != copy->operand || 1 != copy->value)
+    {
+        return std::nullopt;
+    }
+    int32_t flag = decrement->offset;
+    int32_t scratch = copy->offset;
+    if (x == flag || x == scratch || flag == scratch)
+    {
+        return std::nullopt;
+    }
+
+    // The prefix sets up both scratch cells, in any order, and increments x.
+    int found = 0;
+    for (size_t i = begin; i < loop; ++i)
+    {
+        const IrNode &node = block[i];
+        found += IrOp::Set == node.op && flag == node.offset && 1 == node.value;
+        found += IrOp::Set == node.op && scratch == node.offset && 0 == node.value;
+        found += direction > 0 && IrOp::Add == node.op && x == node.offset && 1 == node.value;
+    }
+    if (found != static_cast<int>(loop - begin))
+    {
+        return std::nullopt;
+    }
+
+    auto is = [&](size_t i, IrOp op, int32_t offset, int32_t value, int32_t operand = 0) {
+        return i < block.size() && op == block[i].op && offset == block[i].offset && value == block[i].value &&
+               operand == block[i].operand;
+    };
+
+    // scratch[x+scratch-] restores x.
+    size_t i = loop + 1;
+    if (!is(i, IrOp::MulAdd, x, 1, scratch) || !is(i + 1, IrOp::Set, scratch, 0))
+    {
+        return std::nullopt;
+    }
+    i += 2;
+
+    // The carry into the next cell, either the last level or another chain.
+    int32_t width;
+    if (is(i, IrOp::MulAdd, x + 1, direction, flag) && is(i + 1, IrOp::Set, flag, 0))
+    {
+        width = 2;
+        i += 2;
+    }
+    else if (i < block.size() && IrOp::Loop == block[i].op && block[i].balanced && flag == block[i].offset)
+    {
+        const IrBlock &carry = *block[i].body;
+        if (3 != carry.size() || IrOp::WideAdd != carry[0].op || x + 1 != carry[0].offset ||
+            direction != carry[0].value || carry[1].op != IrOp::Set || carry[2].op != IrOp::Set ||
+            0 != carry[1].value || 0 != carry[2].value ||
+            std::minmax(flag, scratch) != std::minmax(carry[1].offset, carry[2].offset))
+        {
+            return std::nullopt;
+        }
+        width = carry[0].operand + 1;
+        i += 1;
+    }
+    else
+    {
+        return std::nullopt;
+    }
+
+    if (direction < 0)
+    {
+        if (!is(i, IrOp::Add, x, -1))
+        {
+            return std::nullopt;
+        }
+        ++i;
+    }
+
+    auto inside = [&](int32_t cell) { return cell >= x && cell < x + width; };
+    if (width > 8 || inside(flag) || inside(scratch))
+    {
+        return std::nullopt;
+    }
+    return WideMatch{i, x, width, flag, scratch};
+}
+
+// Replaces multi-byte increment and decrement chains with one WideAdd on the
+// little-endian group of cells. Folding afterwards sums repeated ones into a
+// single add of a constant.
+inline void recognize_wide_counters(IrBlock &block)
+{
+    IrBlock rewritten(block.get_allocator());
+    rewritten.reserve(block.size());
+    // Nodes from here on are copied to rewritten as they are.
+    size_t verbatim = 0;
+    for (size_t i = 0; i < block.size(); ++i)
+    {
+        std::optional<WideMatch> match;
+        for (int direction : {1, -1})
+        {
+            size_t prefix = direction > 0 ? 3 : 2;
+            if (!match && IrOp::Loop == block[i].op && i >= verbatim + prefix)
+            {
+                match = match_wide(block, i - prefix, direction);
+                if (match)
+                {
+                    rewritten.resize(rewritten.size() - prefix);
+                    uint32_t origin = block[i - prefix].origin;
+                    rewritten.push_back({IrOp::WideAdd, match->offset, direction, match->width, nullptr, false, origin});
+                    rewritten.push_back({IrOp::Set, match->flag, 0, 0, nullptr, false, origin});
+                    rewritten.push_back({IrOp::Set, match->scratch, 0, 0, nullptr, false, origin});
+                    verbatim = match->end;
+                    i = match->end - 1;
+                }
+            }
+        }
+        if (!match)
+        {
+            rewritten.push_back(block[i]);
+        }
+    }
+    block.swap(rewritten);
+}
+
+// Turns a loop adding a constant to a wide counter once per unit of a cell,
+// a[- carry chain], into one WideMulAdd of the cell into the group. After the
+// pass above its body is a[- WideAdd flag=0 scratch=0], in any order. Clearing
+// the scratch cells still depends on the loop being entered, so the result stays
+// a loop that runs once: a[WideMulAdd flag=0 scratch=0 a=0].
+// Multi-byte compares are not recognized: unlike the carry chain they have no
+// one layout to match, so they run as the byte-wise code they are written as.
+inline void recognize_wide_add_loops(IrProgram &program, IrBlock &block)
+{
+    for (IrNode &node : block)
+    {
+        if (IrOp::Loop != node.op || !node.balanced)
+        {
+            continue;
+        }
+
+        int32_t a = node.offset;
+        const IrNode *wide = nullptr;
+        int decrements = 0;
+        bool matched = true;
+        for (const IrNode &inner : *node.body)
+        {
+            if (IrOp::Add == inner.op && a == inner.offset && -1 == inner.value)
+            {
+                ++decrements;
+            }
+            else if (IrOp::WideAdd == inner.op && nullptr == wide)
+            {
+                wide = &inner;
+            }
+            else if (!(IrOp::Set == inner.op && a != inner.offset && 0 == inner.value))
+            {
+                matched = false;
+            }
+        }
+        if (!matched || 1 != decrements || nullptr == wide || wide->touches(a) ||
+            std::any_of(node.body->begin(), node.body->end(), [wide](const IrNode &inner) {
+                return IrOp::Set == inner.op && wide->touches(inner.offset);
+            }))
+        {
+            continue;
+        }
+
+        IrBlock *body = program.new_block();
+        IrNode add = *wide;
+        add.op = IrOp::WideMulAdd;
+        add.width = wide->operand;
+        add.operand = a;
+        body->push_back(add);
+        for (const IrNode &inner : *node.body)
+        {
+            if (IrOp::Set == inner.op)
+            {
+                body->push_back(inner);
+            }
+        }
+        body->push_back({IrOp::Set, a, 0, 0, nullptr, false, node.origin});
+        node.body = body;
+    }
+}
+
+// Replaces x[-y-x]+y[x-y[-]], which by now reads y -= x, x = 1, y[x-- y=0],
+// with one Eq leaving x == y in x and clearing y.
+inline void recognize_equality(IrBlock &block)
+{
+    IrBlock rewritten(block.get_allocator());
+    rewritten.reserve(block.size());
+    for (size_t i = 0; i < block.size(); ++i)
+    {
+        const IrNode &subtract = block[i];
+        if (IrOp::MulAdd == subtract.op && -1 == subtract.value && i + 2 < block.size())
+        {
+            int32_t x = subtract.operand;
+            int32_t y = subtract.offset;
+            const IrNode &set = block[i + 1];
+            const IrNode &test = block[i + 2];
+            auto is = [](const IrNode &node, IrOp op, int32_t offset, int32_t value) {
+                return op == node.op && offset == node.offset && value == node.value;
+            };
+            if (is(set, IrOp::Set, x, 1) && IrOp::Loop == test.op && test.balanced && y == test.offset &&
+                2 == test.body->size() &&
+                ((is((*test.body)[0], IrOp::Add, x, -1) && is((*test.body)[1], IrOp::Set, y, 0)) ||
+                 (is((*test.body)[0], IrOp::Set, y, 0) && is((*test.body)[1], IrOp::Add, x, -1))))
+            {
+                rewritten.push_back({IrOp::Eq, x, 0, y, nullptr, false, subtract.origin});
+                i += 2;
+                continue;
+            }
+        }
+        rewritten.push_back(block[i]);
+    }
+    block.swap(rewritten);
+}
+
+// Nodes in the block, loop bodies included.
+inline size_t ir_size(const IrBlock &block)
+{
+    size_t size = block.size();
+    for (const IrNode &node : block)
+    {
+        size += IrOp::Loop == node.op ? ir_size(*node.body) : 0;
+    }
+    return size;
+}
+
+// Cells written by the block, with duplicates.
+inline void written_cells(const IrBlock &block, std::vector<int32_t> &cells)
+{
+    for (const IrNode &node : block)
+    {
+        switch (node.op)
+        {
+        case IrOp::Add:
+        case IrOp::Set:
+        case IrOp::In:
+        case IrOp::MulAdd:
+            cells.push_back(node.offset);
+            break;
+        case IrOp::WideAdd:
+            for (int32_t i = 0; i < node.operand; ++i)
+            {
+                cells.push_back(node.offset + i);
+            }
+            break;
+        case IrOp::WideMulAdd:
+            for (int32_t i = 0; i < node.width; ++i)
+            {
+                cells.push_back(node.offset + i);
+            }
+            break;
+        case IrOp::Eq:
+            cells.push_back(node.offset);
+            cells.push_back(node.operand);
+            break;
+        case IrOp::Lt:
+            cells.push_back(node.offset - 2);
+            for (int32_t i = 0; i <= 3; ++i)
+            {
+                cells.push_back(node.offset + i);
+            }
+            break;
+        case IrOp::Loop:
+            cells.push_back(node.offset);
+            written_cells(*node.body, cells);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+// What is known about the cells at one point of a block, relative to its frame.
+class KnownCells
+{
+public:
+    explicit KnownCells(bool zero_tape)
+        : m_rest_zero(zero_tape)
+    {
+    }
+
+    std::optional<uint8_t> operator[](int32_t cell) const
+    {
+        auto it = m_cells.find(cell);
+        if (m_cells.end() == it)
+        {
+            return m_rest_zero ? std::optional<uint8_t>(0) : std::nullopt;
+        }
+        return it->second;
+    }
+
+    void set(int32_t cell, std::optional<uint8_t> value)
+    {
+        m_cells[cell] = value;
+    }
+
+    void move(int32_t distance)
+    {
+        std::map<int32_t, std::optional<uint8_t>> moved;
+        for (const auto &[cell, value] : m_cells)
+        {
+            moved.emplace(cell - distance, value);
+        }
+        m_cells.swap(moved);
+    }
+
+    void forget()
+    {
+        m_cells.clear();
+        m_rest_zero = false;
+    }
+
+private:
+    std::map<int32_t, std::optional<uint8_t>> m_cells;
+    bool m_rest_zero;
+};
+
+constexpr size_t full_unroll_size = 256;
+constexpr size_t partial_unroll_size = 64;
+
+// Iterations of a loop on a cell holding value whose body only changes the cell
+// by adding step, if it ever stops. A body that ends by clearing the cell, like
+// the closed forms that keep a loop as their guard, runs once.
+inline std::optional<size_t> trip_count(const IrNode &loop, uint8_t value)
+{
+    const IrBlock &body = *loop.body;
+    if (!body.empty() && IrOp::Set == body.back().op && loop.offset == body.back().offset && 0 == body.back().value)
+    {
+        return 1;
+    }
+
+    uint8_t step = 0;
+    for (const IrNode &node : *loop.body)
+    {
+        if (IrOp::Add == node.op && loop.offset == node.offset)
+        {
+            step += node.value;
+        }
+        else if (node.touches(loop.offset))
+        {
+            return std::nullopt;
+        }
+    }
+    for (size_t n = 1; n <= 0x100; ++n)
+    {
+        if (0 == static_cast<uint8_t>(value + n * step))
+        {
+            return n;
+        }
+    }
+    return std::nullopt;
+}
+
+// Tracks known cell values forward through the block, from a zero tape at the
+// start of the program and from nothing known anywhere else. Known values turn
+// MulAdds into Adds and drop loops that can't be entered and stores that change
+// nothing. Balanced loops with a known trip count are unrolled: in full while the
+// copies fit the budget, so their bodies fold into straight-line code and nested
+// loops can be unrolled in turn, or else by a factor that divides the trip count.
+inline void propagate_constants(IrProgram &program, IrBlock &block, bool zero_tape, size_t &unroll_budget)
+{
+    struct Walk
+    {
+        IrProgram &program;
+        size_t &unroll_budget;
+        KnownCells known;
+        IrBlock out;
+
+        void forget_written(const IrNode &loop)
+        {
+            std::vector<int32_t> cells;
+            written_cells(*loop.body, cells);
+            for (int32_t cell : cells)
+            {
+                known.set(cell, std::nullopt);
+            }
+            known.set(loop.offset, 0);
+        }
+
+        void walk(const IrBlock &block)
+        {
+            for (const IrNode &node : block)
+            {
+                std::optional<uint8_t> cell = known[node.offset];
+                switch (node.op)
+                {
+                case IrOp::Add:
+                    known.set(node.offset, cell ? std::optional<uint8_t>(*cell + node.value) : std::nullopt);
+                    out.push_back(node);
+                    break;
+                case IrOp::Set:
+                    if (cell != static_cast<uint8_t>(node.value))
+                    {
+                        known.set(node.offset, node.value);
+                        out.push_back(node);
+                    }
+                    break;
+                case IrOp::MulAdd:
+                    if (std::optional<uint8_t> source = known[node.operand])
+                    {
+                        int8_t add = static_cast<int8_t>(*source * node.value);
+                        if (0 != add)
+                        {
+                            known.set(node.offset, cell ? std::optional<uint8_t>(*cell + add) : std::nullopt);
+                            out.push_back({IrOp::Add, node.offset, add, 0, nullptr, false, node.origin});
+                        }
+                        break;
+                    }
+                    known.set(node.offset, std::nullopt);
+                    out.push_back(node);
+                    break;
+                case IrOp::WideAdd:
+                    for (int32_t i = 0; i < node.operand; ++i)
+                    {
+                        known.set(node.offset + i, std::nullopt);
+                    }
+                    out.push_back(node);
+                    break;
+                case IrOp::WideMulAdd:
+                {
+                    std::optional<uint8_t> source = known[node.operand];
+                    if (0 == source)
+                    {
+                        break;
+                    }
+                    for (int32_t i = 0; i < node.width; ++i)
+                    {
+                        known.set(node.offset + i, std::nullopt);
+                    }
+                    out.push_back(node);
+                    if (source && std::abs(int64_t(*source) * node.value) <= INT32_MAX)
+                    {
+                        out.back() = {IrOp::WideAdd, node.offset, *source * node.value, node.width, nullptr, false,
+                                      node.origin};
+                    }
+                    break;
+                }
+                case IrOp::Eq:
+                {
+                    std::optional<uint8_t> right = known[node.operand];
+                    known.set(node.offset, cell && right ? std::optional<uint8_t>(*cell == *right) : std::nullopt);
+                    known.set(node.operand, 0);
+                    out.push_back(node);
+                    break;
+                }
+                case IrOp::Lt:
+                    known.set(node.offset - 2, std::nullopt);
+                    known.set(node.offset, 0);
+                    known.set(node.offset + 1, std::nullopt);
+                    known.set(node.offset + 2, 1);
+                    known.set(node.offset + 3, 0);
+                    out.push_back(node);
+                    break;
+                case IrOp::DivMod:
+                    if (0 != cell)
+                    {
+                        known.forget();
+                        out.push_back(node);
+                    }
+                    break;
+                case IrOp::In:
+                    known.set(node.offset, std::nullopt);
+                    out.push_back(node);
+                    break;
+                case IrOp::Out:
+                    out.push_back(node);
+                    break;
+                case IrOp::Move:
+                    known.move(node.value);
+                    out.push_back(node);
+                    break;
+                case IrOp::Loop:
+                    if (0 == cell)
+                    {
+                        break;
+                    }
+                    if (!node.balanced)
+                    {
+                        known.forget();
+                        out.push_back(node);
+                        break;
+                    }
+                    unroll(node, cell ? trip_count(node, *cell) : std::nullopt);
+                    break;
+                }
+            }
+        }
+
+        void unroll(const IrNode &loop, std::optional<size_t> trips)
+        {
+            size_t size = ir_size(*loop.body);
+            if (trips && *trips * size <= std::min(full_unroll_size, unroll_budget))
+            {
+                unroll_budget -= *trips * size;
+                for (size_t i = 0; i < *trips; ++i)
+                {
+                    walk(*program.clone(*loop.body));
+                }
+                return;
+            }
+
+            size_t factor = 1;
+            for (size_t k = 2; trips && k * size <= std::min(partial_unroll_size, unroll_budget); ++k)
+            {
+                factor = 0 == *trips % k ? k : factor;
+            }
+            out.push_back(loop);
+            if (factor > 1)
+            {
+                unroll_budget -= factor * size;
+                IrBlock *body = program.new_block();
+                for (size_t i = 0; i < factor; ++i)
+                {
+                    const IrBlock *copy = program.clone(*loop.body);
+                    body->insert(body->end(), copy->begin(), copy->end());
+                }
+                fold_adds(*body);
+                eliminate_dead_stores(*body);
+                out.back().body = body;
+            }
+            forget_written(loop);
+        }
+    };
+
+    Walk walk{program, unroll_budget, KnownCells(zero_tape), IrBlock(block.get_allocator())};
+    walk.walk(block);
+    block.swap(walk.out);
+}
+
+constexpr size_t peel_budget = 64;
+
+// Whether the block leaves the cell zero, by setting it or looping on it last.
+inline bool ends_zero(const IrBlock &block, int32_t cell)
+{
+    size_t last = last_touching(block, block.size(), cell);
+    return SIZE_MAX != last && block[last].offset == cell &&
+           ((IrOp::Set == block[last].op && 0 == block[last].value) || IrOp::Loop == block[last].op);
+}
+
+// A Set the body starts its cell with only matters on the first iteration when
+// the cell holds that value again at the end of the body: either nothing else in
+// the body touches it, an invariant store, or the body ends by storing the same
+// value or by a loop on it, which leaves it zero. Such loops are peeled, x[body]
+// becoming x[body x[rest]], where rest drops those stores, so they run once per
+// entry instead of once per iteration. The peel is only kept when rest folds
+// further without them, say into a closed form, or the body would just be there
+// twice. Loops that run at most once are left alone.
+inline void peel_loops(IrProgram &program, IrBlock &block)
+{
+    for (IrNode &node : block)
+    {
+        if (IrOp::Loop != node.op || !node.balanced || ends_zero(*node.body, node.offset) ||
+            ir_size(*node.body) > peel_budget)
+        {
+            continue;
+        }
+
+        IrBlock &body = *node.body;
+        IrBlock *rest = program.new_block();
+        for (size_t k = 0; k < body.size(); ++k)
+        {
+            const IrNode &store = body[k];
+            if (IrOp::Set == store.op && node.offset != store.offset &&
+                SIZE_MAX == last_touching(body, k, store.offset))
+            {
+                size_t last = last_touching(body, body.size(), store.offset);
+                const IrNode &end = body[last];
+                if (last == k || (0 == store.value && ends_zero(body, store.offset)) ||
+                    (IrOp::Set == end.op && store.offset == end.offset && store.value == end.value))
+                {
+                    continue;
+                }
+            }
+            rest->push_back(store);
+            if (IrOp::Loop == store.op)
+            {
+                rest->back().body = program.clone(*store.body);
+            }
+        }
+
+        if (rest->size() == body.size())
+        {
+            continue;
+        }
+
+        IrBlock peeled(block.get_allocator());
+        peeled.push_back({IrOp::Loop, node.offset, 0, 0, rest, true, node.origin});
+        size_t peeled_size = ir_size(peeled);
+        lower_simple_loops(*rest);
+        fold_adds(*rest);
+        eliminate_dead_stores(*rest);
+        lower_simple_loops(peeled);
+        if (ir_size(peeled) < peeled_size)
+        {
+            body.insert(body.end(), peeled.begin(), peeled.end());
+            fold_adds(body);
+            eliminate_dead_stores(body);
+        }
+    }
+}
+
+constexpr size_t default_unroll_budget = 0x1000;
+
+// Optimizes loop bodies first, then the block around them. Only the root block
+// starts on a tape known to be zero.
+inline void optimize_block(IrProgram &program, IrBlock &block, bool zero_tape, size_t &unroll_budget)
+{
+    for (IrNode &node : block)
+    {
+        if (IrOp::Loop == node.op)
+        {
+            optimize_block(program, *node.body, false, unroll_budget);
+        }
+    }
+
+    // The idioms are matched on the stores as written, before constant
+    // propagation drops the ones that happen to store what the cell holds.
+    lower_simple_loops(block);
+    fold_adds(block);
+    recognize_wide_counters(block);
+    recognize_wide_add_loops(program, block);
+    recognize_equality(block);
+    propagate_constants(program, block, zero_tape, unroll_budget);
+    fold_adds(block);
+    eliminate_dead_stores(block);
+    peel_loops(program, block);
+}
+
+// The whole optimizer: builds the IR, rewrites it and lowers it back. Unless
+// zero_tape is cleared, the result assumes it starts at the first record on a
+// zero tape.
+inline PackedProgram optimize(const PackedProgram &program, bool zero_tape = true)
+{
+    IrProgram ir(program);
+    size_t budget = default_unroll_budget;
+    optimize_block(ir, ir.root(), zero_tape, budget);
+    return ir.emit();
+}
+
+// The same, with map describing program on the way in and the result on the
+// way out. Records made out of a node map to the record it was built from,
+// closing brackets to the one that matched it in program.
+inline PackedProgram optimize(const PackedProgram &program, SourceMap &map, bool zero_tape = true)
+{
+    IrProgram ir(program);
+    size_t budget = default_unroll_budget;
+    optimize_block(ir, ir.root(), zero_tape, budget);
+    std::vector<uint32_t> origins;
+    PackedProgram optimized = ir.emit(&origins);
+
+    SourceMap remapped = map.derived();
+    for (size_t i = 0; i < optimized.size();)
+    {
+        Opcode opcode = optimized[i].opcode();
+        size_t origin = origins[i];
+        if (Opcode::JumpNonzero == opcode && Opcode::JumpZero == program[origin].opcode())
+        {
+            origin += program[origin].operand();
+        }
+        for (size_t n = packed_length(opcode); n > 0; --n, ++i)
+        {
+            remapped.push(map.offset(origin));
+        }
+    }
+    map = std::move(remapped);
+    return optimized;
+}
@@ -0,0 +1,556 @@
+#pragma once
+
+#include "bf.hpp"
+#include "sourcemap.hpp"
+
+enum class Opcode : uint8_t
+{
+    Add,
+    Move,
+    In,
+    Out,
+    JumpZero,
+    JumpNonzero,
+    // Produced by the optimizer only. The record holds a cell offset and is
+    // followed by literal records for the rest of its operands, if any.
+    Set,
+    MulAdd,
+    WideAdd,
+    WideMulAdd,
+    Eq,
+    Lt,
+    DivMod,
+};
+
+// One instruction in four bytes: the opcode in the low bits and a signed operand
+// in the rest. Add and Move carry their run length, jumps the distance to the
+// matching bracket.
+class PackedInstruction
+{
+public:
+    static constexpr unsigned opcode_bits = 5;
+    static constexpr int32_t operand_max = (int32_t(1) << (31 - opcode_bits)) - 1;
+    static constexpr int32_t operand_min = -operand_max - 1;
+
+    PackedInstruction(Opcode opcode, int32_t operand = 0)
+        : m_word((static_cast<uint32_t>(operand) << opcode_bits) | static_cast<uint32_t>(opcode))
+    {
+    }
+
+    Opcode opcode() const
+    {
+        return static_cast<Opcode>(m_word & ((1u << opcode_bits) - 1));
+    }
+
+    int32_t operand() const
+    {
+        return static_cast<int32_t>(m_word) >> opcode_bits;
+    }
+
+    // A full 32-bit operand trailing an optimizer record, never dispatched on.
+    static PackedInstruction literal(int32_t value)
+    {
+        PackedInstruction instruction(Opcode::Add);
+        instruction.m_word = static_cast<uint32_t>(value);
+        return instruction;
+    }
+
+    int32_t literal() const
+    {
+        return static_cast<int32_t>(m_word);
+    }
+
+private:
+    uint32_t m_word;
+};
+
+static_assert(sizeof(PackedInstruction) == 4);
+
+// Whether the opcode is one only the optimizer produces.
+inline bool is_extended(Opcode opcode)
+{
+    return opcode > Opcode::JumpNonzero;
+}
+
+// Records taken up by an instruction, its literals included.
+inline size_t packed_length(Opcode opcode)
+{
+    switch (opcode)
+    {
+    case Opcode::Set:
+    case Opcode::Eq:
+    case Opcode::DivMod:
+        return 2;
+    case Opcode::MulAdd:
+    case Opcode::WideAdd:
+        return 3;
+    case Opcode::WideMulAdd:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+// A whole program in one contiguous array. Parsing makes a single allocation:
+// runs of +- and <> fold into one record, and the stack of open brackets is
+// threaded through the operands of the JumpZero records still waiting for their
+// match, which hold the distance back to the enclosing open bracket.
+class PackedProgram
+{
+public:
+    // Anything but commands in the code is skipped. With map given, every record
+    // is mapped to the offset in code of the first character folded into it.
+    explicit PackedProgram(std::string_view code, SourceMap *map = nullptr)
+    {
+        m_instructions.reserve(code.size());
+
+        size_t open = SIZE_MAX;
+        for (size_t offset = 0; offset < code.size(); ++offset)
+        {
+            size_t records = m_instructions.size();
+            char c = code[offset];
+            switch (c)
+            {
+            case '+':
+                add(1);
+                break;
+            case '-':
+                add(-1);
+                break;
+            case '>':
+                move(1);
+                break;
+            case '<':
+                move(-1);
+                break;
+            case '.':
+                m_instructions.emplace_back(Opcode::Out);
+                break;
+            case ',':
+                m_instructions.emplace_back(Opcode::In);
+                break;
+            case '[':
+                m_instructions.emplace_back(Opcode::JumpZero, SIZE_MAX == open ? 0 : distance(open, m_instructions.size()));
+                open = m_instructions.size() - 1;
+                break;
+            case ']':
+            {
+                if (SIZE_MAX == open)
+                {
+                    throw std::invalid_argument("unmatched ']'");
+                }
+                size_t j = open;
+                size_t i = m_instructions.size();
+                int32_t enclosing = m_instructions[j].operand();
+                open = 0 == enclosing ? SIZE_MAX : j - enclosing;
+
+                m_instructions[j] = PackedInstruction(Opcode::JumpZero, distance(j, i));
+                m_instructions.emplace_back(Opcode::JumpNonzero, -distance(j, i));
+                break;
+            }
+            }
+
+            // A fold keeps the record where it was or takes it away.
+            if (nullptr != map && records < m_instructions.size())
+            {
+                map->push(offset);
+            }
+            else if (nullptr != map && records > m_instructions.size())
+            {
+                map->pop();
+            }
+        }
+
+        if (SIZE_MAX != open)
+        {
+            throw std::invalid_argument("unmatched '['");
+        }
+    }
+
+    // Takes records that are already laid out, jumps and literals included.
+    explicit PackedProgram(std::vector<PackedInstruction> instructions)
+        : m_instructions(std::move(instructions))
+    {
+    }
+
+    const PackedInstruction &operator[](size_t i) const
+    {
+        return m_instructions[i];
+    }
+
+    const PackedInstruction *data() const
+    {
+        return m_instructions.data();
+    }
+
+    size_t size() const
+    {
+        return m_instructions.size();
+    }
+
+    static int32_t distance(size_t from, size_t to)
+    {
+        if (to - from > static_cast<size_t>(PackedInstruction::operand_max))
+        {
+            throw std::length_error("loop too long to encode");
+        }
+        return static_cast<int32_t>(to - from);
+    }
+
+private:
+    bool folds_into(Opcode opcode) const
+    {
+        return !m_instructions.empty() && opcode == m_instructions.back().opcode();
+    }
+
+    void add(int32_t n)
+    {
+        if (folds_into(Opcode::Add))
+        {
+            n = (m_instructions.back().operand() + n) & 0xff;
+            m_instructions.pop_back();
+            if (0 == n)
+            {
+                return;
+            }
+        }
+        m_instructions.emplace_back(Opcode::Add, n & 0xff);
+    }
+
+    void move(int32_t n)
+    {
+        if (folds_into(Opcode::Move))
+        {
+            int32_t folded = m_instructions.back().operand();
+            if (folded + n >= PackedInstruction::operand_min && folded + n <= PackedInstruction::operand_max)
+            {
+                m_instructions.pop_back();
+                if (0 == folded + n)
+                {
+                    return;
+                }
+                n += folded;
+            }
+        }
+        m_instructions.emplace_back(Opcode::Move, n);
+    }
+
+    std::vector<PackedInstruction> m_instructions;
+};
+
+// Records right after a guarded instruction holding the original code, run
+// when the guard fails and skipped when it holds. Zero for everything else.
+inline size_t fallback_length(const PackedInstruction *instruction)
+{
+    return Opcode::DivMod == instruction[0].opcode() ? instruction[1].literal() : 0;
+}
+
+// Executes one of the optimizer's records and returns how many records to go
+// on by: its own length, plus its fallback when the guard held. cell(offset)
+// returns the cell at that distance from the data pointer, so every engine can
+// hand in its own view of the tape.
+template <class Cell>
+inline size_t execute_extended(const PackedInstruction *instruction, Cell cell)
+{
+    int32_t offset = instruction[0].operand();
+    size_t length = packed_length(instruction[0].opcode());
+    switch (instruction[0].opcode())
+    {
+    case Opcode::Set:
+        cell(offset) = instruction[1].literal();
+        break;
+    case Opcode::MulAdd:
+        cell(offset) += cell(instruction[1].literal()) * instruction[2].literal();
+        break;
+    case Opcode::WideAdd:
+    {
+        // A little-endian group of cells treated as one unsigned integer.
+        int32_t width = instruction[1].literal();
+        uint64_t value = 0;
+        for (int32_t i = width - 1; i >= 0; --i)
+        {
+            value = value << 8 | cell(offset + i);
+        }
+        value += static_cast<int64_t>(instruction[2].literal());
+        for (int32_t i = 0; i < width; ++i)
+        {
+            cell(offset + i) = static_cast<uint8_t>(value >> 8 * i);
+        }
+        break;
+    }
+    case Opcode::WideMulAdd:
+    {
+        // The same group, plus the cell at the third record times the fourth.
+        int32_t width = instruction[1].literal();
+        uint64_t value = 0;
+        for (int32_t i = width - 1; i >= 0; --i)
+        {
+            value = value << 8 | cell(offset + i);
+        }
+        value += static_cast<int64_t>(cell(instruction[2].literal())) * instruction[3].literal();
+        for (int32_t i = 0; i < width; ++i)
+        {
+            cell(offset + i) = static_cast<uint8_t>(value >> 8 * i);
+        }
+        break;
+    }
+    case Opcode::Eq:
+    {
+        // x[-y-x]+y[x-y[-]]: x becomes x == y, y is cleared.
+        uint8_t &y = cell(instruction[1].literal());
+        cell(offset) = cell(offset) == y;
+        y = 0;
+        break;
+    }
+    case Opcode::Lt:
+    {
+        // The x < y from the wiki run on its temporaries: x and y sit right
+        // before the cell at offset, the three-cell block right after it.
+        uint8_t x = cell(offset - 2);
+        uint8_t y = cell(offset - 1);
+        cell(offset - 2) = x < y;
+        cell(offset) = 0;
+        cell(offset + 1) = x < y ? y - x : 0;
+        cell(offset + 2) = 1;
+        cell(offset + 3) = 0;
+        break;
+    }
+    case Opcode::DivMod:
+    {
+        // [->+>-[>+>>]>[+[-<+>]>+>>]<<<<<<] on n 0 d 0 0 0 leaves
+        // 0 n d-n%d n%d n/d. It only works out for d > 1 with the cells past d
+        // clear; anything else runs the loop itself.
+        uint8_t n = cell(offset);
+        uint8_t d = cell(offset + 2);
+        if (d < 2 || 0 != cell(offset + 3) || 0 != cell(offset + 4) || 0 != cell(offset + 5) ||
+            0 != cell(offset + 6))
+        {
+            break;
+        }
+        cell(offset) = 0;
+        cell(offset + 1) += n;
+        cell(offset + 2) = d - n % d;
+        cell(offset + 3) = n % d;
+        cell(offset + 4) = n / d;
+        return length + fallback_length(instruction);
+    }
+    default:
+        break;
+    }
+    return length;
+}
+
+// Executes one packed record against any state, shared by the engines below.
+template <class BFState, class Outputter, class Inputter>
+inline void execute_packed(
+    const PackedInstruction &instruction,
+    BFState &state,
+    const Outputter &outputter,
+    const Inputter &inputter)
+{
+    switch (instruction.opcode())
+    {
+    case Opcode::Add:
+        state.field[state.data_counter] += instruction.operand();
+        break;
+    case Opcode::Move:
+        state.data_counter += instruction.operand();
+        break;
+    case Opcode::In:
+        state.field[state.data_counter] = inputter.in();
+        break;
+    case Opcode::Out:
+        outputter.out(state.field[state.data_counter]);
+        break;
+    case Opcode::JumpZero:
+        if (0 == state.field[state.data_counter])
+        {
+            state.program_counter = state.program_counter + instruction.operand();
+        }
+        break;
+    case Opcode::JumpNonzero:
+        if (0 != state.field[state.data_counter])
+        {
+            state.program_counter = state.program_counter + instruction.operand();
+        }
+        break;
+    default:
+        state.program_counter += execute_extended(&instruction, [&state](ptrdiff_t offset) -> uint8_t & {
+            return state.field[state.data_counter + offset];
+        }) - 1;
+        break;
+    }
+}
+
+// A plain switch over the packed records with the program counter kept local.
+template <
+    class BFState,
+    class Outputter = StdOutputter,
+    class Inputter = StdInputter>
+class PackedInterpreter : private Outputter, private Inputter
+{
+public:
+    PackedInterpreter(
+        PackedProgram program,
+        Outputter outputter = Outputter(),
+        Inputter inputter = Inputter())
+        : Outputter(std::move(outputter)),
+          Inputter(std::move(inputter)),
+          m_program(std::move(program))
+    {
+    }
+
+    bool finished(const BFState &state) const
+    {
+        return state.program_counter >= m_program.size();
+    }
+
+    void step(BFState &state) const
+    {
+        execute_packed<BFState, Outputter, Inputter>(m_program[state.program_counter], state, *this, *this);
+        state.program_counter++;
+    }
+
+    void interpret(BFState &state) const
+    {
+        const PackedInstruction *code = m_program.data();
+        size_t size = m_program.size();
+        size_t pc = state.program_counter;
+        size_t dc = state.data_counter;
+
+        while (pc < size)
+        {
+            const PackedInstruction instruction = code[pc];
+            switch (instruction.opcode())
+            {
+            case Opcode::Add:
+                state.field[dc] += instruction.operand();
+                break;
+            case Opcode::Move:
+                dc += instruction.operand();
+                break;
+            case Opcode::In:
+                state.field[dc] = this->in();
+                break;
+            case Opcode::Out:
+                this->out(state.field[dc]);
+                break;
+            case Opcode::JumpZero:
+                if (0 == state.field[dc])
+                {
+                    pc += instruction.operand();
+                }
+                break;
+            case Opcode::JumpNonzero:
+                if (0 != state.field[dc])
+                {
+                    pc += instruction.operand();
+                }
+                break;
+            default:
+                pc += execute_extended(code + pc, [&state, dc](ptrdiff_t offset) -> uint8_t & {
+                    return state.field[dc + offset];
+                }) - 1;
+                break;
+            }
+            ++pc;
+        }
+
+        state.program_counter = pc;
+        state.data_counter = dc;
+    }
+
+private:
+    PackedProgram m_program;
+};
+
+// Keeps the current cell in a local and the data pointer as a raw pointer, so
+// runs of Add and the jump tests never go through memory. The cell is written
+// back before the pointer moves, before output and on exit. Needs a contiguous
+// tape and bypasses any bookkeeping the tape does in operator[].
+template <
+    class BFState,
+    class Outputter = StdOutputter,
+    class Inputter = StdInputter>
+class CachedCellInterpreter : private Outputter, private Inputter
+{
+public:
+    CachedCellInterpreter(
+        PackedProgram program,
+        Outputter outputter = Outputter(),
+        Inputter inputter = Inputter())
+        : Outputter(std::move(outputter)),
+          Inputter(std::move(inputter)),
+          m_program(std::move(program))
+    {
+    }
+
+    bool finished(const BFState &state) const
+    {
+        return state.program_counter >= m_program.size();
+    }
+
+    void step(BFState &state) const
+    {
+        execute_packed<BFState, Outputter, Inputter>(m_program[state.program_counter], state, *this, *this);
+        state.program_counter++;
+    }
+
+    void interpret(BFState &state) const
+    {
+        const PackedInstruction *code = m_program.data();
+        size_t size = m_program.size();
+        size_t pc = state.program_counter;
+        uint8_t *base = &state.field[0];
+        uint8_t *ptr = base + state.data_counter;
+        uint8_t cell = *ptr;
+
+        while (pc < size)
+        {
+            const PackedInstruction instruction = code[pc];
+            switch (instruction.opcode())
+            {
+            case Opcode::Add:
+                cell += instruction.operand();
+                break;
+            case Opcode::Move:
+                *ptr = cell;
+                ptr += instruction.operand();
+                cell = *ptr;
+                break;
+            case Opcode::In:
+                cell = this->in();
+                break;
+            case Opcode::Out:
+                *ptr = cell;
+                this->out(cell);
+                break;
+            case Opcode::JumpZero:
+                if (0 == cell)
+                {
+                    pc += instruction.operand();
+                }
+                break;
+            case Opcode::JumpNonzero:
+                if (0 != cell)
+                {
+                    pc += instruction.operand();
+                }
+                break;
+            default:
+                *ptr = cell;
+                pc += execute_extended(code + pc, [ptr](ptrdiff_t offset) -> uint8_t & { return ptr[offset]; }) - 1;
+                cell = *ptr;
+                break;
+            }
+            ++pc;
+        }
+
+        *ptr = cell;
+        state.program_counter = pc;
+        state.data_counter = ptr - base;
+    }
+
+private:
+    PackedProgram m_program;
+};
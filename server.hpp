@@ -0,0 +1,479 @@
+#pragma once
+
+#include "bf.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Wire format, native endian since both ends live on the same machine.
+// A request is a header followed by the source and the input. A request flagged
+// request_lookup carries no source and asks for a cached program by hash, getting
+// response_miss if it isn't there. Any other request is compiled from its source,
+// even an empty one, and filed under the hash of what was sent, not the one claimed.
+// Sources and inputs past the server's caps get response_too_large and the
+// connection is closed.
+// max_steps and max_millis can only lower the server's budget, 0 keeps it.
+// The response is a stream of [u32 size][bytes] chunks ended by [u32 0][u8 status].
+struct RequestHeader
+{
+    uint64_t hash;
+    uint64_t max_steps;
+    uint64_t max_millis;
+    uint32_t source_size;
+    uint32_t input_size;
+    uint32_t flags;
+};
+
+constexpr uint32_t request_lookup = 1;
+
+// Statuses past the last RunStatus.
+constexpr uint8_t response_compile_error = static_cast<uint8_t>(RunStatus::NonTerminating) + 1;
+constexpr uint8_t response_miss = response_compile_error + 1;
+constexpr uint8_t response_time_limit = response_miss + 1;
+constexpr uint8_t response_too_large = response_time_limit + 1;
+
+constexpr size_t server_cache_capacity = 64;
+constexpr size_t server_chunk_size = 0x1000;
+constexpr uint64_t server_max_steps = 1ull << 32;
+constexpr uint64_t server_max_millis = 10000;
+constexpr uint32_t server_max_source_size = 16 << 20;
+constexpr uint32_t server_max_input_size = 16 << 20;
+// Steps run between looks at the clock.
+constexpr uint64_t server_slice_steps = 1 << 20;
+
+// FNV-1a over the filtered source, both ends must agree on it.
+inline uint64_t program_hash(std::string_view code)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (char c : code)
+    {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+inline bool read_exact(int fd, void *buffer, size_t size)
+{
+    uint8_t *bytes = static_cast<uint8_t *>(buffer);
+    while (0 != size)
+    {
+        ssize_t ret = read(fd, bytes, size);
+        if (ret < 0 && EINTR == errno)
+        {
+            continue;
+        }
+        if (ret <= 0)
+        {
+            return false;
+        }
+        bytes += ret;
+        size -= ret;
+    }
+    return true;
+}
+
+inline bool write_exact(int fd, const void *buffer, size_t size)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(buffer);
+    while (0 != size)
+    {
+        ssize_t ret = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (ret < 0 && EINTR == errno)
+        {
+            continue;
+        }
+        if (ret <= 0)
+        {
+            return false;
+        }
+        bytes += ret;
+        size -= ret;
+    }
+    return true;
+}
+
+// Batches output into chunks so a chatty program doesn't cost a syscall per byte.
+class ChunkWriter
+{
+public:
+    explicit ChunkWriter(int fd)
+        : m_fd(fd)
+    {
+        m_buffer.reserve(server_chunk_size);
+    }
+
+    void put(uint8_t x)
+    {
+        m_buffer.push_back(x);
+        if (m_buffer.size() == server_chunk_size)
+        {
+            flush();
+        }
+    }
+
+    void flush()
+    {
+        if (m_buffer.empty())
+        {
+            return;
+        }
+        uint32_t size = m_buffer.size();
+        m_ok = m_ok && write_exact(m_fd, &size, sizeof(size)) && write_exact(m_fd, m_buffer.data(), size);
+        m_buffer.clear();
+    }
+
+    bool finish(uint8_t status)
+    {
+        flush();
+        uint32_t end = 0;
+        m_ok = m_ok && write_exact(m_fd, &end, sizeof(end)) && write_exact(m_fd, &status, sizeof(status));
+        return m_ok;
+    }
+
+private:
+    int m_fd;
+    bool m_ok = true;
+    std::vector<uint8_t> m_buffer;
+};
+
+// Cached programs run on several workers at once, so each worker binds its own
+// output for the duration of a request.
+class WorkerOutputter
+{
+public:
+    void out(uint8_t x) const
+    {
+        t_writer->put(x);
+    }
+
+    static inline thread_local ChunkWriter *t_writer = nullptr;
+};
+
+using ServerState = BrainfuckState<size_t, size_t, TapePool::Lease>;
+using ServerCode = FlyweightCode<ServerState, WorkerOutputter, ThreadSpanInputter>;
+
+// A decoded program and the loops watched while running it, shared by the workers.
+struct ServerProgram
+{
+    explicit ServerProgram(std::string code_string)
+        : code(code_string),
+          loops(code_string),
+          interpreter(ServerCode(std::move(code_string)))
+    {
+    }
+
+    // Kept to tell programs whose hashes collide apart.
+    std::string code;
+    LoopWatch loops;
+    BrainfuckInterpreter<ServerCode, ServerState> interpreter;
+};
+
+class ProgramCache
+{
+public:
+    explicit ProgramCache(size_t capacity)
+        : m_capacity(capacity)
+    {
+    }
+
+    std::shared_ptr<const ServerProgram> find(uint64_t hash)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_index.find(hash);
+        if (m_index.end() == it)
+        {
+            return nullptr;
+        }
+        m_entries.splice(m_entries.begin(), m_entries, it->second);
+        return it->second->second;
+    }
+
+    void insert(uint64_t hash, std::shared_ptr<const ServerProgram> program)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_index.count(hash))
+        {
+            return;
+        }
+        m_entries.emplace_front(hash, std::move(program));
+        m_index[hash] = m_entries.begin();
+        if (m_entries.size() > m_capacity)
+        {
+            m_index.erase(m_entries.back().first);
+            m_entries.pop_back();
+        }
+    }
+
+private:
+    using Entry = std::pair<uint64_t, std::shared_ptr<const ServerProgram>>;
+
+    size_t m_capacity;
+    std::mutex m_mutex;
+    std::list<Entry> m_entries;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> m_index;
+};
+
+class Server
+{
+public:
+    Server(const char *path, size_t workers)
+        : m_cache(server_cache_capacity)
+    {
+        m_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (-1 == m_listen_fd)
+        {
+            throw std::system_error(errno, std::generic_category(), "socket");
+        }
+
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (std::strlen(path) >= sizeof(address.sun_path))
+        {
+            close(m_listen_fd);
+            throw std::invalid_argument("socket path too long");
+        }
+        std::strcpy(address.sun_path, path);
+        unlink(path);
+
+        if (-1 == bind(m_listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) ||
+            -1 == listen(m_listen_fd, SOMAXCONN))
+        {
+            int err = errno;
+            close(m_listen_fd);
+            throw std::system_error(err, std::generic_category(), "bind");
+        }
+
+        // Every worker holds a tape for as long as it runs, have them waiting.
+        default_tape_pool().reserve(RunLimits().tape_size, workers);
+        for (size_t i = 0; i < workers; ++i)
+        {
+            m_workers.emplace_back(&Server::work, this);
+        }
+    }
+
+    Server(const Server &) = delete;
+    Server &operator=(const Server &) = delete;
+
+    void serve()
+    {
+        for (;;)
+        {
+            int fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (-1 == fd)
+            {
+                if (EINTR == errno || ECONNABORTED == errno)
+                {
+                    continue;
+                }
+                throw std::system_error(errno, std::generic_category(), "accept");
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending.push_back(fd);
+            m_pending_cv.notify_one();
+        }
+    }
+
+private:
+    void work()
+    {
+        ServerState state{0ull, 0ull, default_tape_pool().acquire(RunLimits().tape_size)};
+
+        for (;;)
+        {
+            int fd;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_pending_cv.wait(lock, [this]() { return !m_pending.empty(); });
+                fd = m_pending.front();
+                m_pending.pop_front();
+            }
+
+            while (handle(fd, state))
+            {
+            }
+            close(fd);
+        }
+    }
+
+    // Serves one request, false once the connection is done with.
+    bool handle(int fd, ServerState &state)
+    {
+        RequestHeader header;
+        if (!read_exact(fd, &header, sizeof(header)))
+        {
+            return false;
+        }
+
+        if (header.source_size > server_max_source_size || header.input_size > server_max_input_size)
+        {
+            ChunkWriter(fd).finish(response_too_large);
+            return false;
+        }
+
+        std::string source(header.source_size, '\0');
+        std::vector<uint8_t> input(header.input_size);
+        if (!read_exact(fd, source.data(), source.size()) ||
+            !read_exact(fd, input.data(), input.size()))
+        {
+            return false;
+        }
+
+        ChunkWriter writer(fd);
+        std::shared_ptr<const ServerProgram> program;
+        if (0 != (header.flags & request_lookup))
+        {
+            program = m_cache.find(header.hash);
+            if (nullptr == program)
+            {
+                return writer.finish(response_miss);
+            }
+        }
+        else
+        {
+            std::string code_string;
+            std::copy_if(source.begin(), source.end(), std::back_inserter(code_string), is_bf_char);
+            uint64_t hash = program_hash(code_string);
+            program = m_cache.find(hash);
+            if (nullptr == program || program->code != code_string)
+            {
+                try
+                {
+                    program = std::make_shared<const ServerProgram>(std::move(code_string));
+                }
+                catch (const std::invalid_argument &)
+                {
+                    return writer.finish(response_compile_error);
+                }
+                m_cache.insert(hash, program);
+            }
+        }
+
+        SpanInput span_input{input, 0};
+        ThreadSpanInputter::t_input = &span_input;
+        WorkerOutputter::t_writer = &writer;
+        uint8_t status = run_budgeted(*program, state, header);
+        reset(state);
+
+        return writer.finish(status);
+    }
+
+    // Runs in slices of steps so the clock is only read now and then. The client's
+    // limits are capped by the server's own.
+    static uint8_t run_budgeted(const ServerProgram &program, ServerState &state, const RequestHeader &header)
+    {
+        uint64_t max_steps = std::min(0 == header.max_steps ? server_max_steps : header.max_steps, server_max_steps);
+        uint64_t max_millis =
+            std::min(0 == header.max_millis ? server_max_millis : header.max_millis, server_max_millis);
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(max_millis);
+
+        RunLimits limits;
+        for (;;)
+        {
+            limits.max_steps = std::min(max_steps, server_slice_steps);
+            RunResult result =
+                execute_limited(program.interpreter, state, limits, []() { return false; }, &program.loops);
+            max_steps -= result.steps;
+            if (RunStatus::StepLimit != result.status || 0 == max_steps)
+            {
+                return static_cast<uint8_t>(result.status);
+            }
+            if (std::chrono::steady_clock::now() >= deadline)
+            {
+                return response_time_limit;
+            }
+        }
+    }
+
+    int m_listen_fd;
+    ProgramCache m_cache;
+
+    std::mutex m_mutex;
+    std::condition_variable m_pending_cv;
+    std::deque<int> m_pending;
+    std::vector<std::thread> m_workers;
+};
+
+// Receives one response, writing the output to stdout. Returns the status byte.
+inline int receive_response(int fd)
+{
+    for (;;)
+    {
+        uint32_t size;
+        if (!read_exact(fd, &size, sizeof(size)))
+        {
+            return -1;
+        }
+        if (0 == size)
+        {
+            break;
+        }
+
+        std::vector<uint8_t> chunk(size);
+        if (!read_exact(fd, chunk.data(), size))
+        {
+            return -1;
+        }
+        std::fwrite(chunk.data(), 1, size, stdout);
+    }
+
+    uint8_t status;
+    if (!read_exact(fd, &status, sizeof(status)))
+    {
+        return -1;
+    }
+    return status;
+}
+
+// Asks for the program by hash first and only ships the source on a miss.
+inline int run_client(const char *path, const std::string &code_string, const std::vector<uint8_t> &input)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (-1 == fd)
+    {
+        throw std::system_error(errno, std::generic_category(), "socket");
+    }
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    if (-1 == connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)))
+    {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(), "connect");
+    }
+
+    RequestHeader header{program_hash(code_string), 0, 0, 0, static_cast<uint32_t>(input.size()), request_lookup};
+    int status = -1;
+    if (write_exact(fd, &header, sizeof(header)) && write_exact(fd, input.data(), input.size()))
+    {
+        status = receive_response(fd);
+    }
+
+    if (response_miss == status)
+    {
+        header.source_size = code_string.size();
+        header.flags = 0;
+        status = -1;
+        if (write_exact(fd, &header, sizeof(header)) &&
+            write_exact(fd, code_string.data(), code_string.size()) &&
+            write_exact(fd, input.data(), input.size()))
+        {
+            status = receive_response(fd);
+        }
+    }
+
+    std::fflush(stdout);
+    close(fd);
+    return status;
+}
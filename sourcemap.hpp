@@ -0,0 +1,151 @@
+#pragma once
+
+#include "bf.hpp"
+
+// Where each record of a program came from in its source, kept apart from the
+// records so nothing that runs them pays for it. Offsets are stored as runs of
+// records whose offsets step by the same stride, so code without comments in it
+// takes one run however long it is, and the records an optimizer makes out of
+// one loop take one run between them. Line starts are kept to turn an offset
+// into a line and column.
+class SourceMap
+{
+public:
+    // Both counted from 1.
+    struct Position
+    {
+        size_t line;
+        size_t column;
+    };
+
+    SourceMap() = default;
+
+    // An empty map for records that will point into source.
+    explicit SourceMap(std::string_view source)
+    {
+        if (source.size() > UINT32_MAX)
+        {
+            throw std::length_error("source too long to map");
+        }
+        for (size_t i = 0; i < source.size(); ++i)
+        {
+            if ('\n' == source[i])
+            {
+                m_line_starts.push_back(static_cast<uint32_t>(i + 1));
+            }
+        }
+    }
+
+    // The map of the filtered source, one record per command character, as the
+    // flyweight engines and LoopWatch count program counters.
+    static SourceMap filtered(std::string_view source)
+    {
+        SourceMap map(source);
+        for (size_t i = 0; i < source.size(); ++i)
+        {
+            if (is_bf_char(source[i]))
+            {
+                map.push(i);
+            }
+        }
+        return map;
+    }
+
+    // An empty map into the same source, for a program made out of this one.
+    SourceMap derived() const
+    {
+        SourceMap map;
+        map.m_line_starts = m_line_starts;
+        return map;
+    }
+
+    // Appends a record that starts at the offset.
+    void push(size_t offset)
+    {
+        if (!m_runs.empty())
+        {
+            Run &run = m_runs.back();
+            size_t length = m_records - run.first_record;
+            int64_t step = static_cast<int64_t>(offset) - last_offset();
+            if (1 == length && step >= INT32_MIN && step <= INT32_MAX)
+            {
+                run.stride = static_cast<int32_t>(step);
+                ++m_records;
+                return;
+            }
+            if (step == run.stride)
+            {
+                ++m_records;
+                return;
+            }
+        }
+        m_runs.push_back({static_cast<uint32_t>(m_records), static_cast<uint32_t>(offset), 0});
+        ++m_records;
+    }
+
+    // Drops the last record.
+    void pop()
+    {
+        --m_records;
+        if (m_records == m_runs.back().first_record)
+        {
+            m_runs.pop_back();
+        }
+    }
+
+    size_t size() const
+    {
+        return m_records;
+    }
+
+    size_t runs() const
+    {
+        return m_runs.size();
+    }
+
+    size_t offset(size_t record) const
+    {
+        auto it = std::upper_bound(m_runs.begin(), m_runs.end(), record, [](size_t record, const Run &run) {
+            return record < run.first_record;
+        });
+        const Run &run = *(it - 1);
+        return run.first_offset + static_cast<int64_t>(record - run.first_record) * run.stride;
+    }
+
+    Position position(size_t offset) const
+    {
+        auto it = std::upper_bound(m_line_starts.begin(), m_line_starts.end(), offset);
+        size_t line_start = m_line_starts.begin() == it ? 0 : *(it - 1);
+        return {static_cast<size_t>(it - m_line_starts.begin()) + 1, offset - line_start + 1};
+    }
+
+    // Calls f(first_record, records, first_offset, stride) for every run in order.
+    template <class F>
+    void for_each_run(F f) const
+    {
+        for (size_t k = 0; k < m_runs.size(); ++k)
+        {
+            size_t end = k + 1 == m_runs.size() ? m_records : m_runs[k + 1].first_record;
+            f(m_runs[k].first_record, end - m_runs[k].first_record, m_runs[k].first_offset, m_runs[k].stride);
+        }
+    }
+
+private:
+    struct Run
+    {
+        uint32_t first_record;
+        uint32_t first_offset;
+        int32_t stride;
+    };
+
+    int64_t last_offset() const
+    {
+        const Run &run = m_runs.back();
+        return run.first_offset + static_cast<int64_t>(m_records - 1 - run.first_record) * run.stride;
+    }
+
+    std::vector<Run> m_runs;
+    // Offsets of the lines after the first.
+    std::vector<uint32_t> m_line_starts;
+    size_t m_records = 0;
+};
@@ -0,0 +1,198 @@
+#pragma once
+
+#include "optimizer.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Runs a program as its source comes in, without ever holding all of it. The
+// source is cut into top-level segments at points where no loop is open, and
+// each segment is compiled, run and dropped before the next is read. Only the
+// loops still open at the read position are kept, so memory is bounded by the
+// largest loop and not by the program.
+template <
+    class BFState,
+    class Outputter = StdOutputter,
+    class Inputter = StdInputter>
+class StreamingRunner
+{
+public:
+    // Source bytes collected before a segment is run, when no loop is open.
+    static constexpr size_t segment_bytes = 0x100000;
+    // Source bytes mapped and handed over at a time.
+    static constexpr size_t window_bytes = 0x400000;
+
+    StreamingRunner(
+        bool optimized = false,
+        Outputter outputter = Outputter(),
+        Inputter inputter = Inputter())
+        : m_optimized(optimized),
+          m_outputter(std::move(outputter)),
+          m_inputter(std::move(inputter))
+    {
+    }
+
+    // Takes the next piece of source, running whatever segments it completes.
+    void feed(BFState &state, std::string_view source)
+    {
+        for (char c : source)
+        {
+            if (!is_bf_char(c))
+            {
+                continue;
+            }
+            if ('[' == c)
+            {
+                ++m_depth;
+            }
+            else if (']' == c)
+            {
+                if (0 == m_depth)
+                {
+                    throw std::invalid_argument("unmatched ']'");
+                }
+                --m_depth;
+            }
+            m_segment.push_back(c);
+
+            if (0 == m_depth && m_segment.size() >= segment_bytes)
+            {
+                run_segment(state);
+            }
+        }
+    }
+
+    // Runs what is left once the source is over.
+    void finish(BFState &state)
+    {
+        if (0 != m_depth)
+        {
+            throw std::invalid_argument("unmatched '['");
+        }
+        run_segment(state);
+    }
+
+    // Feeds a whole file. Regular files are mapped for sequential reading and
+    // the pages behind the read position dropped, anything else is read().
+    void run_file(BFState &state, const char *path)
+    {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (-1 == fd)
+        {
+            throw std::system_error(errno, std::generic_category(), "open");
+        }
+
+        try
+        {
+            struct stat st;
+            if (0 == fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0)
+            {
+                run_mapped(state, fd, st.st_size);
+            }
+            else
+            {
+                run_read(state, fd);
+            }
+        }
+        catch (...)
+        {
+            close(fd);
+            throw;
+        }
+        close(fd);
+        finish(state);
+    }
+
+    size_t segments() const
+    {
+        return m_segments;
+    }
+
+    // Most source characters held at once, the largest segment run.
+    size_t peak_segment() const
+    {
+        return m_peak_segment;
+    }
+
+private:
+    void run_segment(BFState &state)
+    {
+        if (m_segment.empty())
+        {
+            return;
+        }
+        m_peak_segment = std::max(m_peak_segment, m_segment.size());
+
+        PackedProgram program(m_segment);
+        if (m_optimized)
+        {
+            // Only the first segment starts on a tape known to be zero.
+            program = optimize(program, 0 == m_segments);
+        }
+        PackedInterpreter<BFState, Outputter, Inputter> interpreter(std::move(program), m_outputter, m_inputter);
+        state.program_counter = 0;
+        interpreter.interpret(state);
+
+        ++m_segments;
+        m_segment.clear();
+    }
+
+    void run_mapped(BFState &state, int fd, size_t size)
+    {
+        void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (MAP_FAILED == mapped)
+        {
+            run_read(state, fd);
+            return;
+        }
+        const char *source = static_cast<const char *>(mapped);
+        madvise(mapped, size, MADV_SEQUENTIAL);
+
+        try
+        {
+            for (size_t offset = 0; offset < size; offset += window_bytes)
+            {
+                size_t length = std::min(window_bytes, size - offset);
+                feed(state, std::string_view(source + offset, length));
+                // Windows start on page boundaries, so this one can go as a whole.
+                madvise(const_cast<char *>(source) + offset, length, MADV_DONTNEED);
+            }
+        }
+        catch (...)
+        {
+            munmap(mapped, size);
+            throw;
+        }
+        munmap(mapped, size);
+    }
+
+    void run_read(BFState &state, int fd)
+    {
+        std::vector<char> chunk(window_bytes);
+        for (;;)
+        {
+            ssize_t ret = read(fd, chunk.data(), chunk.size());
+            if (ret < 0 && EINTR == errno)
+            {
+                continue;
+            }
+            if (ret < 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "read");
+            }
+            if (0 == ret)
+            {
+                break;
+            }
+            feed(state, std::string_view(chunk.data(), ret));
+        }
+    }
+
+    bool m_optimized;
+    Outputter m_outputter;
+    Inputter m_inputter;
+    std::string m_segment;
+    size_t m_depth = 0;
+    size_t m_segments = 0;
+    size_t m_peak_segment = 0;
+};
@@ -0,0 +1,205 @@
+#pragma once
+
+#include "packed.hpp"
+
+#if defined(__has_cpp_attribute)
+#if __has_cpp_attribute(clang::musttail)
+#define CIVI_HAS_MUSTTAIL 1
+#define CIVI_MUSTTAIL [[clang::musttail]]
+#endif
+#endif
+
+#if !defined(CIVI_HAS_MUSTTAIL) && defined(__GNUC__) && __GNUC__ >= 15 && defined(__has_attribute)
+#if __has_attribute(musttail)
+#define CIVI_HAS_MUSTTAIL 1
+#define CIVI_MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+
+// Every handler ends by jumping straight into the next one. Only musttail
+// guarantees the jump: GCC's sibling calls depend on the optimization level,
+// and a call that isn't turned into a jump grows the stack by a frame per
+// instruction. Without musttail handlers return to the driver every so often.
+#if defined(CIVI_HAS_MUSTTAIL)
+#define CIVI_DISPATCH(next)                                     \
+    CIVI_MUSTTAIL return (next)->handler((next), ptr, base, run)
+#else
+#define CIVI_DISPATCH(next)                                \
+    do                                                     \
+    {                                                      \
+        if (0 == --run->fuel)                              \
+        {                                                  \
+            run->pc = (next);                              \
+            run->ptr = ptr;                                \
+            return;                                        \
+        }                                                  \
+        return (next)->handler((next), ptr, base, run);    \
+    } while (0)
+#endif
+
+// Decodes a PackedProgram into threaded code where each record is the address of
+// its handler plus the operand. Handlers are separate functions taking the program
+// counter, the data pointer and the tape base as arguments, so they all stay in
+// registers and the compiler allocates them per handler.
+template <
+    class BFState,
+    class Outputter = StdOutputter,
+    class Inputter = StdInputter>
+class TailCallInterpreter : private Outputter, private Inputter
+{
+public:
+    TailCallInterpreter(
+        PackedProgram program,
+        Outputter outputter = Outputter(),
+        Inputter inputter = Inputter())
+        : Outputter(std::move(outputter)),
+          Inputter(std::move(inputter)),
+          m_program(std::move(program))
+    {
+        m_ops.reserve(m_program.size() + 1);
+        for (size_t i = 0; i < m_program.size(); ++i)
+        {
+            Opcode opcode = m_program[i].opcode();
+            if (is_extended(opcode))
+            {
+                // The literals of extended records get placeholders so indices
+                // still match the program.
+                size_t length = packed_length(opcode);
+                m_ops.push_back({&op_extended, 0});
+                m_ops.insert(m_ops.end(), length - 1, ThreadedOp{&op_halt, 0});
+                i += length - 1;
+                continue;
+            }
+            m_ops.push_back({handler_of(opcode), m_program[i].operand()});
+        }
+        m_ops.push_back({&op_halt, 0});
+    }
+
+    bool finished(const BFState &state) const
+    {
+        return state.program_counter >= m_program.size();
+    }
+
+    void step(BFState &state) const
+    {
+        execute_packed<BFState, Outputter, Inputter>(m_program[state.program_counter], state, *this, *this);
+        state.program_counter++;
+    }
+
+    void interpret(BFState &state) const
+    {
+        if (finished(state))
+        {
+            return;
+        }
+
+        uint8_t *base = &state.field[0];
+        Run run{this, m_ops.data() + state.program_counter, base + state.data_counter, 0, false};
+        while (!run.halted)
+        {
+            run.fuel = fuel_per_dispatch;
+            run.pc->handler(run.pc, run.ptr, base, &run);
+        }
+
+        state.program_counter = run.pc - m_ops.data();
+        state.data_counter = run.ptr - base;
+    }
+
+private:
+    struct Run;
+    struct ThreadedOp;
+
+    using Handler = void (*)(const ThreadedOp *pc, uint8_t *ptr, uint8_t *base, Run *run);
+
+    struct ThreadedOp
+    {
+        Handler handler;
+        intptr_t operand;
+    };
+
+    struct Run
+    {
+        const TailCallInterpreter *engine;
+        const ThreadedOp *pc;
+        uint8_t *ptr;
+        size_t fuel;
+        bool halted;
+    };
+
+    static constexpr size_t fuel_per_dispatch = 0x1000;
+
+    static Handler handler_of(Opcode opcode)
+    {
+        switch (opcode)
+        {
+        case Opcode::Add:
+            return &op_add;
+        case Opcode::Move:
+            return &op_move;
+        case Opcode::In:
+            return &op_in;
+        case Opcode::Out:
+            return &op_out;
+        case Opcode::JumpZero:
+            return &op_jump_zero;
+        case Opcode::JumpNonzero:
+            return &op_jump_nonzero;
+        default:
+            return &op_extended;
+        }
+    }
+
+    static void op_add(const ThreadedOp *pc, uint8_t *ptr, uint8_t *base, Run *run)
+    {
+        *ptr += pc->operand;
+        CIVI_DISPATCH(pc + 1);
+    }
+
+    static void op_move(const ThreadedOp *pc, uint8_t *ptr, uint8_t *base, Run *run)
+    {
+        ptr += pc->operand;
+        CIVI_DISPATCH(pc + 1);
+    }
+
+    static void op_in(const ThreadedOp *pc, uint8_t *ptr, uint8_t *base, Run *run)
+    {
+        *ptr = static_cast<const Inputter *>(run->engine)->in();
+        CIVI_DISPATCH(pc + 1);
+    }
+
+    static void op_out(const ThreadedOp *pc, uint8_t *ptr, uint8_t *base, Run *run)
+    {
+        static_cast<const Outputter *>(run->engine)->out(*ptr);
+        CIVI_DISPATCH(pc + 1);
+    }
+
+    static void op_jump_zero(const ThreadedOp *pc, uint8_t *ptr, uint8_t *base, Run *run)
+    {
+        const ThreadedOp *next = pc + 1 + (0 == *ptr ? pc->operand : 0);
+        CIVI_DISPATCH(next);
+    }
+
+    static void op_jump_nonzero(const ThreadedOp *pc, uint8_t *ptr, uint8_t *base, Run *run)
+    {
+        const ThreadedOp *next = pc + 1 + (0 != *ptr ? pc->operand : 0);
+        CIVI_DISPATCH(next);
+    }
+
+    static void op_extended(const ThreadedOp *pc, uint8_t *ptr, uint8_t *base, Run *run)
+    {
+        const TailCallInterpreter *engine = run->engine;
+        size_t length = execute_extended(engine->m_program.data() + (pc - engine->m_ops.data()),
+                                         [ptr](ptrdiff_t offset) -> uint8_t & { return ptr[offset]; });
+        CIVI_DISPATCH(pc + length);
+    }
+
+    static void op_halt(const ThreadedOp *pc, uint8_t *ptr, uint8_t *, Run *run)
+    {
+        run->pc = pc;
+        run->ptr = ptr;
+        run->halted = true;
+    }
+
+    PackedProgram m_program;
+    std::vector<ThreadedOp> m_ops;
+};